@@ -3,7 +3,7 @@
 **  ENTRY AR1757
 **  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
 **                                                                          
-**  FFS.C:  Stripped down and optimised FAT16 file system routines                                
+**  FFS.C:  Stripped down and optimised FAT16/FAT32/exFAT file system routines                               
 ** 
 // Based on the software from:
 //
@@ -34,7 +34,9 @@
 #endif
 
 #include "FFs.h"
+#include "flac.h"
 #include "mmc.h"
+#include "serial.h"
 #include "types.h"
 
 #include <LPC213x.H>
@@ -42,7 +44,6 @@
 #include <ctype.h>
 #include <stdio.h>
 	 
-static u8 sector[512];
 
 //
 // big-little endian swappers
@@ -89,11 +90,40 @@ inline u32 swap32(u32 x)
 // IDE block size
 #define BLOCKSIZE	512
 
-// Max count of file handles
-#define MAX_FILES	2
+// End of cluster chain, as returned by clust_next() for both FAT16 and FAT32
+#define CLUSTCHAIN_END		((u32) 0x0FFFFFF8)
+
+// End of chain marker written to the FAT (truncated to 0xFFFF on FAT16)
+#define CLUSTCHAIN_EOC		((u32) 0x0FFFFFFF)
+
+// exFAT directory entry types
+#define EXFAT_EOD			((u8) 0x00)	// end of directory
+#define EXFAT_FILE			((u8) 0x85)	// file or directory, primary entry of a set
+#define EXFAT_STREAM		((u8) 0xC0)	// stream extension : cluster, size, flags
+#define EXFAT_NAME			((u8) 0xC1)	// 15 UTF-16 chars of file name
+#define EXFAT_INUSE			((u8) 0x80)
+#define EXFAT_SECONDARY		((u8) 0x40)
+
+// exFAT stream extension flags
+#define EXFAT_NOFATCHAIN	((u8) 0x02)	// clusters are contiguous and not recorded in the FAT
+
+// FAT32 FSInfo sector signatures and "unknown" value
+#define FSI_LEADSIG			((u32) 0x41615252)
+#define FSI_STRUCSIG		((u32) 0x61417272)
+#define FSI_UNKNOWN			((u32) 0xFFFFFFFF)
+
+// Name index slots (power of 2), filled at most 3/4 so probe sequences stay short: 256
+// slots index 192 names, larger directories are scanned past them. Tracks are opened
+// from the catalog, so open() by name only looks up CATALOG.BIN in the root directory.
+// 512 slots (384 names) take 2KB more RAM
+#ifndef NAME_INDEX_SLOTS
+#define NAME_INDEX_SLOTS	256
+#endif
 
-// End of cluster chain
-#define CLUSTCHAIN_END		((u16) 0xFFF8)
+// Sector cache entries. At least 2, so a FAT sector and a directory sector can be held together
+#ifndef SECTOR_CACHE_ENTRIES
+#define SECTOR_CACHE_ENTRIES	4
+#endif
 
 //
 //
@@ -111,28 +141,94 @@ inline u32 swap32(u32 x)
 
 // Drive geometry
 static u32 hd1_start_lba;		// first lba of partiton
-static u8	hd1_geom_secperclust;	// sectors per cluster
-static u16 hd1_geom_rd_size;		// root directory size in sectors
+static u32	hd1_geom_secperclust;	// sectors per cluster (exFAT clusters can exceed 255 sectors)
+static u8	hd1_geom_clustshift;	// log2 of sectors per cluster
+static u32	hd1_geom_clustmask;		// sectors per cluster - 1
+static u16 hd1_geom_rd_size;		// root directory size in sectors (0 on FAT32, where the root is a cluster chain)
 static u32 hd1_geom_offfat;		// 1st sector after 1st FAT
 static u32	hd1_geom_clustsize;	// u8s per cluster
+static u8	hd1_geom_nfats;		// count of FAT copies
+static u32	hd1_geom_nclust;	// 1st cluster number past the end of the volume
+static u32	hd1_volid;			// volume serial number
+
+static bool	hd1_fat32;			// volume has 32-bit FAT entries (FAT32 or exFAT)
+static bool	hd1_exfat;			// volume is exFAT (mounted read only)
+static u8	hd1_fat_shift;		// log2 of FAT entries per sector : 8 on FAT16, 7 on FAT32
+static u32	hd1_fsinfo;			// FAT32 FSInfo sector, 0 if none
+static u32	hd1_free_count;		// FSInfo free cluster count, FSI_UNKNOWN if not known
+static u32	hd1_next_free;		// FSInfo hint of where to look for free clusters
 	   
 
 // Main FS struct properties
 static u32
 	lba_fat,		// FAT 1st sector
 	lba_rd,			// Root directory 1st sector
-	lba_data,		// Partition data area 1st sector
-	lba_curdir,		// Current directory 1st sector (initialized by dir_examine())
-	lba_tmpdir;		// Current sector in current directory (used by dir_exnext())
+	lba_data;		// Partition data area 1st sector
+
+// 1st cluster of a dirent (FstClusHI is only meaningful on FAT32)
+#define de_clust(de)	((hd1_fat32 ? (u32) (de).FstClusHI << 16 : 0) | (de).FstClusLO)
+
+// Offset within its FAT sector of the entry of clust
+#define fat_entry(clust)	(((clust) & ((1 << hd1_fat_shift) - 1)) << (9 - hd1_fat_shift))
 
-static dirent *pde_cur, de_cur; // de_cur is a copy of the current dirent. pde_cur points at the original in secbuf
+// Directory walk. Each walk carries its own position and only borrows the sector cache while
+// stepping, so several walks (e.g. background indexing and a file lookup) can be interleaved
+typedef struct
+{
+	u32 dir;		// 1st sector of the dir
+	u32 end;		// sector past the end of the dir when contiguous (exFAT NoFatChain), 0 if it follows the FAT
+	u32 lba;		// current sector
+	s16 index;		// index of the current dirent within lba
+	u32 set_lba;	// sector holding the (1st) entry of de
+	s16 set_index;	// index of the (1st) entry of de within set_lba
+	dirent de;		// copy of the current dirent
+	bool contig;	// de clusters are contiguous and not in the FAT (exFAT NoFatChain)
+} dir_iter;
+
+static dir_iter dir_cur;		// walk of the current dir, by dir_examine() / dir_next()
+static dirent *pde_cur;			// points at the original of de_cur in secbuf
+
+#define lba_curdir		dir_cur.dir		// Current directory 1st sector (initialized by dir_chdir())
+#define lba_curdir_end	dir_cur.end
+#define lba_tmpdir		dir_cur.lba		// Current sector in current directory
+#define de_index		dir_cur.index
+#define de_cur			dir_cur.de
+#define de_contig		dir_cur.contig
+#define lba_deset		dir_cur.set_lba
+#define de_setindex		dir_cur.set_index
+
+// Hash index of the 8.3 names of the last searched directory
+typedef struct
+{
+	u32 lba;		// sector holding the entry, 0 if slot is free
+	u16 hash;		// hash of the name
+	u8	index;		// index of the entry within its sector
+} name_slot;
+
+static name_slot name_index[NAME_INDEX_SLOTS];
+static u32 name_index_dir;		// 1st sector of the indexed directory, 0 if none
+static bool name_index_full;	// some entries of the directory did not fit in the index
 
 
 // Global file handle table
 static file_handle __files[MAX_FILES];
 
-// Sector cache
-static u32 lba_incache = -1; // valid LBA starts at 1 so 0 is invalid cache
+// Sector buffers of open files
+static u8 file_buffers[FILE_BUFFERS][BLOCKSIZE] __attribute__((aligned(4)));
+static u8 file_buffers_used;				// bit n set when file_buffers[n] belongs to a handle
+
+// Sector cache, with least recently used replacement
+static u8 sector_cache[SECTOR_CACHE_ENTRIES][BLOCKSIZE] __attribute__((aligned(4)));
+static u32 lba_cache[SECTOR_CACHE_ENTRIES] = { [0 ... SECTOR_CACHE_ENTRIES-1] = -1 };	// LBA held by each entry, -1 if none
+static u32 age_cache[SECTOR_CACHE_ENTRIES];	// access stamp of each entry
+static u32 cache_clock;						// last access stamp handed out
+static u32 cache_hits,cache_misses;
+
+static u8 *sector = sector_cache[0];		// most recently accessed entry
+
+// Operation counters
+static fs_op_stats op_stats[FS_OPS];
+static u8 op_cur;							// operation card reads are charged to
 
 //
 //
@@ -147,20 +243,30 @@ static u32 lba_incache = -1; // valid LBA starts at 1 so 0 is invalid cache
 //
 //
 
-static u16  lba2clust(u32 lba)	// lba2clust() : find cluster number from LBA sector address
+static u32  lba2clust(u32 lba)	// lba2clust() : find cluster number from LBA sector address
 {
 	if (lba < lba_data) return 0;	// 0 is error code since clust < 2 is error
 
-	return 2 + (u16) ((lba - lba_data) / hd1_geom_secperclust);
+	return 2 + ((lba - lba_data) >> hd1_geom_clustshift);
 }
 
-static u32  clust2lba(u16 clust)	// clust2lba() : find LBA  address of cluster's 1st sector
+static u32  clust2lba(u32 clust)	// clust2lba() : find LBA  address of cluster's 1st sector
 {
 	if (clust < 2) return 0;	// 0 is error code since LBA < 1 is error
 
-	return lba_data + (u32) (clust - 2) * (u32) hd1_geom_secperclust;
+	return lba_data + ((clust - 2) << hd1_geom_clustshift);
+}
+
+
+// Start an operation : count it and charge the following card reads to it
+static void  fs_op(u8 op)
+{
+	op_cur = op;
+	op_stats[op].calls++;
 }
 
+// Count sectors read from the card by the current operation
+#define fs_op_sectors(n)	(op_stats[op_cur].sectors += (n))
 
 //
 //
@@ -200,16 +306,29 @@ inline u32  peekl(u16 index)
 }
 
 
-// sec_read() : read a sector pointed by lba into secbuf
+// sec_read() : read a sector pointed by lba into the least recently used cache entry
 static void  sec_read(u32 lba)
 {
-	lba_incache = lba;
+	u8 i,victim;
+
+	for(i=victim=0;i<SECTOR_CACHE_ENTRIES;i++)
+	{
+		if(age_cache[i] < age_cache[victim])
+			victim=i;
+	}
+
+	cache_misses++;
+	fs_op_sectors(1);
+
+	sector = sector_cache[victim];
+	age_cache[victim] = ++cache_clock;
 
 #ifdef CCD_DEBUG
 	mprintf("Read sector: %u\n\r",lba);
 #endif
 
-	mmc_SectorRead(sector,lba);	   
+	// Don't keep a sector that failed to read
+	lba_cache[victim] = mmc_SectorRead(sector,lba) ? lba : -1;	   
 }
 
 #ifdef CCD_DEBUG
@@ -237,18 +356,96 @@ static void  dbg_dumpprm(void)
 
 static void  sec_get(u32 *sa)	// Read sector into sector buffer. CHS is recalculated from LBA.
 {
+	u8 i;
 
 	// Simple cache mechanism : don't read an already present sector into buffer
-	if (lba_incache == *sa)
+	for(i=0;i<SECTOR_CACHE_ENTRIES;i++)
 	{
+		if (lba_cache[i] == *sa)
+		{
+			cache_hits++;
 
-		return;
+			sector = sector_cache[i];
+			age_cache[i] = ++cache_clock;
+
+			return;
+		}
 	}
 
 	// 2 - Read sector
 	sec_read(*sa);
 }
 
+// Drop every sector held in the cache (card changed)
+static void  sec_flush(void)
+{
+	u8 i;
+
+	for(i=0;i<SECTOR_CACHE_ENTRIES;i++)
+		lba_cache[i] = -1;
+
+	for(i=0;i<MAX_FILES;i++)
+		__files[i].buflba = -1;
+}
+
+// sec_write() : write buf to the sector pointed by lba, keeping any cached copy up to date
+static bool  sec_write(u32 lba, u8 *buf)
+{
+	u8 i;
+
+	for(i=0;i<SECTOR_CACHE_ENTRIES;i++)
+	{
+		if (lba_cache[i] == lba && sector_cache[i] != buf)
+			memcpy(sector_cache[i], buf, BLOCKSIZE);
+	}
+
+	for(i=0;i<MAX_FILES;i++)
+	{
+		if (__files[i].buflba == lba && __files[i].buf != buf)
+			memcpy(__files[i].buf, buf, BLOCKSIZE);
+	}
+
+	return mmc_SectorWrite(buf, lba);
+}
+
+// Return sector cache hit and miss counts
+void  fs_cache_stats(u32 *hits,u32 *misses)
+{
+	*hits = cache_hits;
+	*misses = cache_misses;
+}
+
+// Return the counters of an operation
+void  fs_get_stats(u8 op, fs_op_stats *stats)
+{
+	*stats = op_stats[op];
+}
+
+void  fs_clear_stats(void)
+{
+	memset(op_stats, 0, sizeof(op_stats));
+	cache_hits = cache_misses = 0;
+}
+
+// Print operation counters and cache efficiency on the serial port
+void  fs_dump_stats(void)
+{
+	static const char *names[FS_OPS] = { "Mount", "Scan", "Open", "Seek", "Read", "Sectors", "Save" };
+	u8 op;
+
+	for (op = 0 ; op < FS_OPS ; op++)
+	{
+		puts(names[op]);
+		puts(" calls ");	puts(itoa(op_stats[op].calls,32));
+		puts(" reads ");	puts(itoa(op_stats[op].sectors,32));
+		puts("\n\r");
+	}
+
+	puts("Cache hits ");	puts(itoa(cache_hits,32));
+	puts(" misses ");		puts(itoa(cache_misses,32));
+	puts("\n\r");
+}
+
 //
 //
 // ****************** LV2 - H A R D   D I S K   I N T E R F A C E   F U N C S ******************
@@ -290,11 +487,15 @@ bool  hd_mbr(void)			// hd_mbr() : read disk Master Boot Record, check it and an
 #define p_offset	446
 #endif
 
+	fs_op(FS_OP_MOUNT);
+
 	// Analyze MBR and find 1st partition boot sector (leave CHS of this BPB in IDE parameters for further read)
 #ifdef CCD_DEBUG
 	mprintf("Chk MBR\n\r");
 #endif
 
+	sec_flush();	// Forget sectors of any previous card
+
 	sec_read(0);	// Read MBR sector
 
 
@@ -354,16 +555,74 @@ bool  hd_mbr(void)			// hd_mbr() : read disk Master Boot Record, check it and an
 
 #endif
 
-	return (!(secbuf(446 /*p_offset*/ + 4) != 6 && secbuf(446 /*p_offset*/ + 4) != 4));	// Only return 0 if 1st partition type is FAT16
+	// Only return TRUE if 1st partition type is FAT16 (4, 6, 0x0E), FAT32 (0x0B, 0x0C) or exFAT (7)
+	switch (secbuf(446 /*p_offset*/ + 4))
+	{
+		case 0x04: case 0x06: case 0x0E:
+		case 0x0B: case 0x0C:
+		case 0x07:
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static bool  exfat_bpb(void)	// Analyze exFAT boot sector (last sector read in secbuf)
+{
+	// Fields are sector offsets from the start of the partition
+	if ((secbuf(510) != 0x55) || (secbuf(511) != 0xaa) || (secbuf(108) != 9)) return FALSE;	// MUST have 512 u8 sectors
+
+	lba_fat = hd1_start_lba + peekl(80);
+	hd1_geom_offfat = lba_fat + peekl(84);
+	lba_data = hd1_start_lba + peekl(88);
+
+	hd1_geom_clustshift = secbuf(109);
+	hd1_geom_secperclust = (u32) 1 << hd1_geom_clustshift;
+	hd1_geom_clustmask = hd1_geom_secperclust - 1;
+	hd1_geom_clustsize = (u32) BLOCKSIZE << hd1_geom_clustshift;
+
+	hd1_geom_rd_size = 0;
+	hd1_geom_nfats = secbuf(110);
+	hd1_geom_nclust = 2 + peekl(92);
+	hd1_volid = peekl(100);
+
+	// FAT entries are 32-bit, the root directory is a cluster chain
+	hd1_fat32 = TRUE;
+	hd1_fat_shift = 7;
+	hd1_fsinfo = 0;
+	hd1_free_count = hd1_next_free = FSI_UNKNOWN;
+
+	lba_curdir = lba_rd = clust2lba(peekl(96));
+	lba_curdir_end = 0;
+
+	return lba_rd != 0;
 }
 
 bool  hd_bpb(void)	// Analyze partition Boot Param Block to find out addresses of FAT and rootdir
 {
 	u8 i;
+	u32 fatsize, clusters;
 
+	fs_op(FS_OP_MOUNT);
 
 	sec_read(hd1_start_lba );
 
+	// Forget the name index of any previous volume
+	name_index_dir = 0;
+
+	// exFAT has its own boot sector layout, with "EXFAT   " as OEM name
+	if ((hd1_exfat = !memcmp(&secbuf(3), "EXFAT   ", 8)))
+	{
+		if (!(exfat_bpb())) return FALSE;
+
+		for(i=0;i<MAX_FILES;i++)
+			__files[i].inuse=0;
+
+		file_buffers_used = 0;
+
+		return TRUE;
+	}
+
 	hd1_geom_rd_size = peekw(17) / 16;/* * 32 / BLOCKSIZE */ 		// Get root dir size
 	hd1_geom_secperclust = secbuf(13);								// Get sector per cluster count
 
@@ -395,31 +654,77 @@ bool  hd_bpb(void)	// Analyze partition Boot Param Block to find out addresses o
 	lba_fat = (u32) peekw( 14)
 		  + peekl( 28);
 
+	// FAT size : 16-bit field, or the FAT32 32-bit one if zero
+	fatsize = peekw( 22) ? (u32) peekw( 22) : peekl( 36);
+
 	// Remember LBA of 1st sector after 1st FAT
-	hd1_geom_offfat = lba_fat + (u32) peekw( 22);
+	hd1_geom_offfat = lba_fat + fatsize;
 
-	// Calculate LBA of root dir : FAT + numFAT * fatsize
-	// Store root dir into current dir
-	lba_curdir = lba_rd = lba_fat + (u32) secbuf(16) * (u32) peekw( 22) ;
+	// Calculate LBA of data area : FAT + numFAT * fatsize + fixed root dir (none on FAT32)
+	lba_data = lba_fat + (u32) secbuf(16) * fatsize + (u32) hd1_geom_rd_size;
 
-	// Calculate LBA of data area : after root dir
-	lba_data = lba_rd + (u32) hd1_geom_rd_size;
+	// Cluster size is a power of 2, so keep its shift and mask to avoid divisions
+	for (hd1_geom_clustshift = 0 ; (1 << hd1_geom_clustshift) < hd1_geom_secperclust ; hd1_geom_clustshift++);
+
+	if (!hd1_geom_secperclust || (1 << hd1_geom_clustshift) != hd1_geom_secperclust) return FALSE;
+
+	hd1_geom_clustmask = hd1_geom_secperclust - 1;
 
 	// Calculate cluster size in u8s (to speedup later calculation)
 	hd1_geom_clustsize = (u32) BLOCKSIZE * (u32) hd1_geom_secperclust;
 
+	// Count of data clusters decides the FAT type
+	clusters = ((peekw(19) ? peekw(19) : peekl(32)) - (lba_data - peekl(28))) >> hd1_geom_clustshift;
+
+	if (clusters < 4085) return FALSE;	// FAT12 is not supported
+
+	hd1_fat32 = (clusters >= 65525);
+	hd1_fat_shift = hd1_fat32 ? 7 : 8;
+
+	// Remember FAT copies, cluster count and serial number for updates and catalog validation
+	hd1_geom_nfats = secbuf(16);
+	hd1_geom_nclust = 2 + clusters;
+	hd1_volid = peekl(hd1_fat32 ? 67 : 39);
+
+	// Calculate LBA of root dir : fixed area after the FATs, or the FAT32 root cluster
+	// Store root dir into current dir
+	lba_curdir = lba_rd = hd1_fat32 ? clust2lba(peekl(44)) : lba_data - (u32) hd1_geom_rd_size;
+	lba_curdir_end = 0;
+
+	// FAT32 free cluster count and allocation hint
+	hd1_fsinfo = 0;
+	hd1_free_count = hd1_next_free = FSI_UNKNOWN;
+
+	if (hd1_fat32 && peekw(48) && peekw(48) != 0xFFFF)
+	{
+		hd1_fsinfo = peekl(28) + peekw(48);
+
+		sec_read(hd1_fsinfo);
+
+		if (peekl(0) == FSI_LEADSIG && peekl(484) == FSI_STRUCSIG)
+		{
+			hd1_free_count = peekl(488);
+			hd1_next_free = peekl(492);
+		}
+		else
+			hd1_fsinfo = 0;
+	}
+
 #ifdef CCD_DEBUG
 	mprintf("Fat   LBA =%u\n\r",lba_fat);
 	mprintf("Root  LBA =%u\n\r",lba_rd);
 	mprintf("Data  LBA =%u\n\r",lba_data);
 	mprintf("LFat  LBA =%u\n\r",hd1_geom_offfat);
 	mprintf("Clustsize =%u\n\r",hd1_geom_clustsize);
+	mprintf("FAT%u\n\r",hd1_fat32 ? 32 : 16);
 #endif
 
 	// clear out file handles
 	for(i=0;i<MAX_FILES;i++)
 		__files[i].inuse=0;
 
+	file_buffers_used = 0;
+
 	return TRUE;
 }
 
@@ -428,14 +733,14 @@ bool  hd_bpb(void)	// Analyze partition Boot Param Block to find out addresses o
 // ****************** LV3 - C L U S T E R   I N T E R F A C E   F U N C S ******************
 //
 //
-static bool  clust_getfat(u16 clust)	// Read into secbuf the FAT sector containing clust.
+static bool  clust_getfat(u32 clust)	// Read into secbuf the FAT sector containing clust.
 								// Return TRUE if Ok, FALSE if error
 {
 	u32 sa;
 
 	// Find out FAT sector number containing cluster#
 	// If we are out of 1st FAT then clust is invalid
-	if ((sa = lba_fat + ((u32) (clust >> 8) /* * (u32) 2 / (u32) BLOCKSIZE*/)) // a cluster # is 2 u8s, a sector is BLOCKSIZE u8s
+	if ((sa = lba_fat + (clust >> hd1_fat_shift)) // a cluster # is 2 (FAT16) or 4 (FAT32) u8s, a sector is BLOCKSIZE u8s
 		>= hd1_geom_offfat) return FALSE;
 
 	// Read in FAT sector
@@ -444,16 +749,21 @@ static bool  clust_getfat(u16 clust)	// Read into secbuf the FAT sector containi
 	return TRUE;
 }
 
-static u16  clust_next(u16 clust)	// Find next cluster in chain. Return CLUSTCHAIN_END if no next,
+static u32  clust_next(u32 clust)	// Find next cluster in chain. Return CLUSTCHAIN_END if no next,
 							// and 0 if error
 {
-	u16 next;
+	u32 next;
 
 	// Read in FAT sector containing clust
 	if (!(clust_getfat(clust))) return 0;
 
-	// Find next cluster entry from FAT
-	if ((next = peekw( (clust % (BLOCKSIZE / 2)) * 2)) >= CLUSTCHAIN_END) next = CLUSTCHAIN_END;	// Above, CLUSTCHAIN_END (End Of cluster Chain)
+	// Find next cluster entry from FAT (the top 4 bits of FAT32 entries are reserved)
+	if (hd1_fat32)
+		next = peekl(fat_entry(clust)) & 0x0FFFFFFF;
+	else if ((next = peekw(fat_entry(clust))) >= 0xFFF8)
+		next = CLUSTCHAIN_END;
+
+	if (next >= CLUSTCHAIN_END) next = CLUSTCHAIN_END;	// Above, CLUSTCHAIN_END (End Of cluster Chain)
 
 	return next;
 }
@@ -462,7 +772,7 @@ static u16  clust_next(u16 clust)	// Find next cluster in chain. Return CLUSTCHA
 static u32  clust_nextlba(u32 lba)	// Find next sector in same cluster chain
 {
 	u32 next = lba + 1;
-	u16 c1, c2;
+	u32 c1, c2;
 
 	// Calculate lba and next clusters
 	c1 = lba2clust(lba);
@@ -479,6 +789,106 @@ static u32  clust_nextlba(u32 lba)	// Find next sector in same cluster chain
 	return 0;
 }
 
+static bool  clust_setfat(u32 clust, u32 next)	// Set the FAT entry of clust in every FAT copy
+{
+	u32 sa;
+	u16 i;
+	u8 n;
+
+	// Read in FAT sector containing clust and update it
+	if (!(clust_getfat(clust))) return FALSE;
+
+	sa = lba_fat + (clust >> hd1_fat_shift);
+	i = fat_entry(clust);
+
+	secbuf(i) = (u8) next;
+	secbuf(i + 1) = (u8) (next >> 8);
+
+	if (hd1_fat32)
+	{
+		// Preserve the reserved top 4 bits
+		secbuf(i + 2) = (u8) (next >> 16);
+		secbuf(i + 3) = (secbuf(i + 3) & 0xF0) | ((u8) (next >> 24) & 0x0F);
+	}
+
+	for (n = 0 ; n < hd1_geom_nfats ; n++)
+		if (!(sec_write(sa + n * (hd1_geom_offfat - lba_fat), sector))) return FALSE;
+
+	return TRUE;
+}
+
+static void  fsinfo_update(s32 delta)	// Account for delta clusters being freed in the FAT32 FSInfo sector
+{
+	if (!hd1_fsinfo) return;
+
+	if (hd1_free_count != FSI_UNKNOWN)
+		hd1_free_count += delta;
+
+	sec_get(&hd1_fsinfo);
+
+	memcpy(&secbuf(488), &hd1_free_count, 4);
+	memcpy(&secbuf(492), &hd1_next_free, 4);
+
+	sec_write(hd1_fsinfo, sector);
+}
+
+static u32  clust_alloc(u32 count)	// Allocate a chain of count contiguous free clusters.
+								// Return its 1st cluster, 0 if no such free run
+{
+	u32 clust, first, start = 0, len = 0;
+
+	// Start at the FSInfo hint if any, then wrap around once
+	first = (hd1_next_free >= 2 && hd1_next_free < hd1_geom_nclust) ? hd1_next_free : 2;
+
+	for (clust = first ; ; )
+	{
+		if (!(clust_getfat(clust))) return 0;
+
+		// In use clusters break the run
+		if (hd1_fat32 ? (peekl(fat_entry(clust)) & 0x0FFFFFFF) : peekw(fat_entry(clust)))
+			len = 0;
+		else if (!(len++))
+			start = clust;
+
+		if (len == count)
+		{
+			for (clust = start ; clust < start + count ; clust++)
+				if (!(clust_setfat(clust, clust + 1 < start + count ? clust + 1 : CLUSTCHAIN_EOC))) return 0;
+
+			hd1_next_free = start + count;
+			fsinfo_update(-(s32) count);
+
+			return start;
+		}
+
+		if (++clust >= hd1_geom_nclust)
+		{
+			// Runs don't wrap past the end of the volume
+			clust = 2;
+			len = 0;
+		}
+
+		if (clust == first) return 0;
+	}
+}
+
+static void  clust_free(u32 clust)	// Release a cluster chain
+{
+	u32 next, n = 0;
+
+	while ((clust >= 2) && (clust < CLUSTCHAIN_END))
+	{
+		next = clust_next(clust);
+
+		if (!(clust_setfat(clust, 0))) break;
+
+		n++;
+		clust = next;
+	}
+
+	fsinfo_update(n);
+}
+
 //
 //
 // ****************** LV4 - F I L E   T R E E   I N T E R F A C E   F U N C S ******************
@@ -493,50 +903,166 @@ static u32  clust_nextlba(u32 lba)	// Find next sector in same cluster chain
 #define DE_FREE_LAST	((u8) 0x00)
 #define DE_NONE			((u8) 0xFF)
 
+static u32  dir_nextlba(dir_iter *it, u32 lba)	// Find next sector of the dir walked by it. Return 0 at its end
+{
+	// Contiguous exFAT directories are not in the FAT
+	if (it -> end)
+		return (lba + 1 < it -> end) ? lba + 1 : 0;
+
+	// FAT16 root dir is a fixed area, so merely go to next sector checking we're below hd1_geom_rd_size
+	if (hd1_geom_rd_size && (it -> dir == lba_rd))
+		return (lba + 1 < lba_data) ? lba + 1 : 0;
+
+	// Otherwise find next sector of current dir in its cluster chain
+	return clust_nextlba(lba);
+}
+
+
+static void  dir_open(dir_iter *it, catalog_entry *dir)	// Start a walk of dir (root dir if NULL) before its 1st dirent
+{
+	it -> end = 0;
+
+	if (!dir || !(dir -> clust))
+		it -> dir = lba_rd;
+	else
+	{
+		it -> dir = clust2lba(dir -> clust);
+
+		if (dir -> flags & CATALOG_CONTIG)
+			it -> end = it -> dir + (dir -> size + BLOCKSIZE - 1) / BLOCKSIZE;
+	}
+
+	it -> lba = it -> dir;
+	it -> index = -1;
+}
+
+static void  dir_chdir(catalog_entry *dir)	// Make dir (root dir if NULL) the current dir
+{
+	dir_open(&dir_cur, dir);
+}
+
+static s16  exfat_entry(dir_iter *it)	// Step to next exFAT dir entry. Return its offset in secbuf, -1 at end of dir
+{
+	if (++(it -> index) >= (s16) (BLOCKSIZE / sizeof(dirent)))
+	{
+		if (!(it -> lba = dir_nextlba(it, it -> lba))) return -1;
+
+		it -> index = 0;
+	}
+
+	sec_get(&(it -> lba));
+
+	return it -> index * sizeof(dirent);
+}
+
+static bool  exfat_next(dir_iter *it)	// Translate next exFAT file entry set into it -> de
+{
+	s16 e;
+	u8 type, left = 0, namelen = 0, n, base = 0, ext = 0;
+	bool inext = FALSE;
+	char ch;
+
+	while ((e = exfat_entry(it)) >= 0)
+	{
+		type = secbuf(e);
+
+		if (type == EXFAT_EOD) return FALSE;
+
+		// A primary entry starts a new set, anything else not in use breaks the current one
+		if (type == EXFAT_FILE)
+		{
+			left = secbuf(e + 1);
+			it -> set_lba = it -> lba;
+			it -> set_index = it -> index;
+
+			memset(&(it -> de), 0, sizeof(dirent));
+			memset(it -> de.Name, ' ', 11);
+			it -> de.Attr = (u8) peekw(e + 4) & ~ATTR_VOLUME_ID;
+			it -> contig = FALSE;
+			base = ext = namelen = 0;
+			inext = FALSE;
+			continue;
+		}
+
+		if (!left || (type & (EXFAT_INUSE | EXFAT_SECONDARY)) != (EXFAT_INUSE | EXFAT_SECONDARY))
+		{
+			left = 0;
+			continue;
+		}
+
+		if (type == EXFAT_STREAM)
+		{
+			it -> contig = (secbuf(e + 1) & EXFAT_NOFATCHAIN) != 0;
+			namelen = secbuf(e + 3);
+			it -> de.FstClusLO = peekw(e + 20);
+			it -> de.FstClusHI = peekw(e + 22);
+			it -> de.FileSize = peekl(e + 28) ? 0xFFFFFFFF : peekl(e + 24);	// files over 4GB are clipped
+		}
+		else if (type == EXFAT_NAME)
+		{
+			// Fold the long name into an 8.3 one : up to 8 chars before the 1st dot, up to 3 after the last
+			for (n = 0 ; n < 15 && namelen ; n++, namelen--)
+			{
+				ch = secbuf(e + 3 + 2 * n) ? '_' : toupper(secbuf(e + 2 + 2 * n));
+
+				if (ch == '.')
+				{
+					inext = TRUE;
+					ext = 0;
+					memset(&(it -> de.Name[8]), ' ', 3);
+				}
+				else if (inext)
+				{
+					if (ext < 3) it -> de.Name[8 + ext++] = ch;
+				}
+				else if (base < 8)
+					it -> de.Name[base++] = ch;
+			}
+		}
+
+		if (!(--left)) return TRUE;
+	}
+
+	return FALSE;
+}
 
-bool  dir_next(bool bfree)	// dir_next() : return next dirent
+static bool  dir_read(dir_iter *it, bool bfree)	// dir_read() : step it to its next dirent
 							// If bfree is FALSE then we look for an unused dirent.
 							// If bfree is TRUE then we look for an used dirent.
 {
 	u8 c;
+
+	// exFAT is read only, so only used entries are looked for
+	if (hd1_exfat) return bfree ? FALSE : exfat_next(it);
+
+	it -> contig = FALSE;
 	
 	// Read current directory sector into buffer
-	sec_get(&lba_tmpdir);
+	sec_get(&(it -> lba));
 
 	do
 	{
 		// Go to next dirent
-		++pde_cur;
-
-		// Put 1st char of current dirent filename into c;
-		c = pde_cur -> Name[0];
+		++(it -> index);
 
 		// If we go outside secbuf, go to next sector of directory (if any)
-		if (((u32) pde_cur - (u32) sector) >= BLOCKSIZE)
+		if (it -> index >= (s16) (BLOCKSIZE / sizeof(dirent)))
 		{
 			c = (bfree ? 1 : DE_FREE); // Prepare to loop in there
 
-			if (lba_curdir == lba_rd)	// We're in root dir so we merely go to next sector checking we're below hd1_geom_rd_size
-			{
-				if (lba_tmpdir - lba_curdir < hd1_geom_rd_size)
-					lba_tmpdir++;
-				else
-					c = (bfree ? DE_NONE : DE_FREE_LAST);
-			}
-			else	// We're not in root dir so find next sector of current dir in its cluster chain
-			{
-				if (!(lba_tmpdir = clust_nextlba(lba_tmpdir)))
-					c = (bfree ? DE_NONE : DE_FREE_LAST);
-			}
+			if (!(it -> lba = dir_nextlba(it, it -> lba)))
+				c = (bfree ? DE_NONE : DE_FREE_LAST);
 
 			if (c != (bfree ? DE_NONE : 0))	// We are on a new dir sector, read it in and prepare next scan
 			{
-				sec_get(&lba_tmpdir);
+				sec_get(&(it -> lba));
 
-				pde_cur = (dirent *) sector;
-				--pde_cur;
+				it -> index = -1;
 			}
 		}
+		else
+			// Put 1st char of current dirent filename into c;
+			c = ((dirent *) sector)[it -> index].Name[0];
 	}
 	while ((bfree ?		// skip (un)used entries
 			/* unused */	((c != DE_FREE_LAST) && (c != DE_FREE) && (c != DE_NONE))
@@ -546,7 +1072,10 @@ bool  dir_next(bool bfree)	// dir_next() : return next dirent
 	// If we are on a (un)used entry then return OK
 	if ((bfree ? (c != DE_NONE) : (c != DE_FREE_LAST)))
 	{
-		memcpy(&de_cur,pde_cur,sizeof(de_cur));
+		it -> set_lba = it -> lba;
+		it -> set_index = it -> index;
+
+		memcpy(&(it -> de), (dirent *) sector + it -> index, sizeof(dirent));
 
 		return TRUE;
 	}
@@ -554,14 +1083,24 @@ bool  dir_next(bool bfree)	// dir_next() : return next dirent
 	return FALSE;
 }
 
+bool  dir_next(bool bfree)	// dir_next() : return next dirent of the current dir
+{
+	if (!dir_read(&dir_cur, bfree))
+		return FALSE;
+
+	// On FAT the entry is in the sector read last (exFAT is read only and never writes it back)
+	pde_cur = (dirent *) sector + de_setindex;
+
+	return TRUE;
+}
+
 bool  dir_examine(bool bfree)	// dir_examine() : start scan of current dir and return first (un)used dirent
 {
 	// Set current directory sector to 1st sector of current dir
 	lba_tmpdir = lba_curdir;
 
 	// "Rewind back" so that dir_next starts scan at 1st dirent
-	pde_cur = (dirent *) sector;
-	--pde_cur;
+	de_index = -1;
 
 	// Find next dirent
 	return dir_next(bfree);
@@ -617,9 +1156,58 @@ static char *  __create_83_name(char *filename)
 	return name83;
 }
 
+static u16  __name_hash(const char *name83)	// FNV-1a hash of an 8.3 name, folded to 16 bits
+{
+	u32 h = 2166136261UL;
+	u8 i;
+
+	for (i = 0 ; i < 11 ; i++)
+	{
+		h ^= (u8) name83[i];
+		h *= 16777619UL;
+	}
+
+	return (u16) (h ^ (h >> 16));
+}
+
+static void  name_index_build(void)	// Index the names of the current dir
+{
+	u16 n = 0, slot, hash;
+
+	memset(name_index, 0, sizeof(name_index));
+
+	name_index_dir = lba_curdir;
+	name_index_full = FALSE;
+
+	if (dir_examine(FILE_USED))
+	{
+		do
+		{
+			if (de_cur.Attr == ATTR_LONG_NAME)
+				continue;
+
+			if (n++ >= NAME_INDEX_SLOTS / 4 * 3)
+			{
+				name_index_full = TRUE;
+				break;
+			}
+
+			hash = __name_hash(de_cur.Name);
+
+			for (slot = hash & (NAME_INDEX_SLOTS - 1) ; name_index[slot].lba ; slot = (slot + 1) & (NAME_INDEX_SLOTS - 1));
+
+			name_index[slot].lba = lba_deset;
+			name_index[slot].hash = hash;
+			name_index[slot].index = (u8) de_setindex;
+		}
+		while (dir_next(FILE_USED));
+	}
+}
+
 bool  dir_findbyname(char *filename)
 {
 	char *name = __create_83_name(filename);
+	u16 slot, hash;
 
 #ifdef CCD_DEBUG
 	char tmp[12];
@@ -628,6 +1216,28 @@ bool  dir_findbyname(char *filename)
 
 #endif
 
+	// Index the directory on first touch, then only read the sectors of entries with the same hash
+	if (name_index_dir != lba_curdir)
+		name_index_build();
+
+	hash = __name_hash(name);
+
+	for (slot = hash & (NAME_INDEX_SLOTS - 1) ; name_index[slot].lba ; slot = (slot + 1) & (NAME_INDEX_SLOTS - 1))
+	{
+		if (name_index[slot].hash != hash)
+			continue;
+
+		// Parse the entry (set) again to fill de_cur
+		lba_tmpdir = name_index[slot].lba;
+		de_index = (s16) name_index[slot].index - 1;
+
+		if (dir_next(FILE_USED) && !(strncmp(name, de_cur.Name, 11)))
+			return TRUE;
+	}
+
+	// Entries past a full index can only be found by scanning
+	if (!name_index_full)
+		return FALSE;
 
 	if (dir_examine(FILE_USED))
 	{
@@ -679,8 +1289,188 @@ static u8  __h_findfree(void)
 	return hnum;
 }
 
-s8  close(u8 handle)
-									/* Close file handle
+// File sector offset of the start of run i
+#define __h_runstart(fd,i)	((i) ? (fd) -> map[(i) - 1].end : 0)
+
+// Build the map of contiguous runs of a file, following its cluster chain until
+// the chain ends or the map is full
+static void  __h_map(file_handle *fd)
+{
+	u32 clust = fd -> clust;
+	u32 lba, sectors = 0;
+	extent *run = NULL;
+
+	fd -> extents = 0;
+	fd -> complete = TRUE;
+
+	while ((clust >= 2) && (clust < CLUSTCHAIN_END))
+	{
+		lba = clust2lba(clust);
+
+		// Extend the current run if this cluster follows it on the card
+		if (run && (run -> lba + run -> end - __h_runstart(fd, fd -> extents - 1) == lba))
+			run -> end += hd1_geom_secperclust;
+		else
+		{
+			if (fd -> extents == FILE_MAX_EXTENTS)
+			{
+				fd -> complete = FALSE;
+				break;
+			}
+
+			run = &(fd -> map[fd -> extents++]);
+			run -> lba = lba;
+			run -> end = sectors + hd1_geom_secperclust;
+		}
+
+		sectors += hd1_geom_secperclust;
+		clust = clust_next(clust);
+	}
+}
+
+// Position the handle on file sector secno
+static void  __h_locate(file_handle *fd, u32 secno)
+{
+	u8 lo = 0, hi = fd -> extents, mid;
+	u32 clust, clustcnt;
+	u32 mapped;
+
+	// Binary search for the 1st run ending after secno
+	while (lo < hi)
+	{
+		mid = (lo + hi) >> 1;
+
+		if (fd -> map[mid].end > secno)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	fd -> ext = lo;
+
+	if (lo < fd -> extents)
+	{
+		fd -> sector_rl = fd -> map[lo].end - secno - 1;
+		fd -> curlba = fd -> map[lo].lba + (secno - __h_runstart(fd, lo));
+		return;
+	}
+
+	fd -> sector_rl = 0;
+	fd -> curlba = 0; // flag for extending chain
+
+	if (fd -> complete || !(fd -> extents))
+		return;
+
+	// Past the map : follow the FAT from the last mapped cluster
+	mapped = fd -> map[lo - 1].end;
+	clustcnt = ((secno - mapped) >> hd1_geom_clustshift) + 1;
+	clust = lba2clust(fd -> map[lo - 1].lba + (mapped - __h_runstart(fd, lo - 1)) - 1);
+
+	while ((clustcnt--) && (clust < CLUSTCHAIN_END)) clust = clust_next(clust);
+
+	if ((clust >= 2) && (clust < CLUSTCHAIN_END))
+	{
+		fd -> sector_rl = hd1_geom_clustmask - ((secno - mapped) & hd1_geom_clustmask);
+		fd -> curlba = clust2lba(clust) + ((secno - mapped) & hd1_geom_clustmask);
+	}
+}
+
+// Advance the handle by n sectors, at most to the end of the current run (sector_rl+1)
+static void  __h_advance(file_handle *fd, u32 n)
+{
+	if (n <= fd -> sector_rl)
+	{
+		fd -> sector_rl -= n;
+		fd -> curlba += n;
+		return;
+	}
+
+	// Run exhausted : move to the next mapped run
+	if (fd -> ext < fd -> extents)
+	{
+		if (++(fd -> ext) < fd -> extents)
+		{
+			fd -> curlba = fd -> map[fd -> ext].lba;
+			fd -> sector_rl = fd -> map[fd -> ext].end - __h_runstart(fd, fd -> ext) - 1;
+			return;
+		}
+
+		if (fd -> complete)
+		{
+			fd -> curlba = 0;
+			fd -> sector_rl = 0;
+			return;
+		}
+	}
+
+	// Past the map : the rest of each cluster found in the FAT is contiguous
+	fd -> curlba = clust_nextlba(fd -> curlba + n - 1);
+	fd -> sector_rl = fd -> curlba ? (hd1_geom_clustmask - ((fd -> curlba - lba_data) & hd1_geom_clustmask)) : 0;
+}
+
+// Hand a free sector buffer to fd. Without one, fd shares the sector cache
+static void  __h_getbuf(file_handle *fd)
+{
+	u8 n;
+
+	fd -> buf = NULL;
+	fd -> buflba = -1;
+
+	for (n = 0 ; n < FILE_BUFFERS ; n++)
+	{
+		if (!(file_buffers_used & (1 << n)))
+		{
+			file_buffers_used |= 1 << n;
+			fd -> buf = file_buffers[n];
+			return;
+		}
+	}
+}
+
+// Give the sector buffer of fd back to the pool
+static void  __h_putbuf(file_handle *fd)
+{
+	if (fd -> buf)
+		file_buffers_used &= ~(1 << ((fd -> buf - file_buffers[0]) / BLOCKSIZE));
+
+	fd -> buf = NULL;
+	fd -> buflba = -1;
+}
+
+// Set up a free handle on the file starting at clust. A contig file is a single
+// run of clusters that is not recorded in the FAT (exFAT NoFatChain)
+static void  __h_open(file_handle *fd, u32 clust, u32 size, u8 oflag, bool contig)
+{
+	fd -> size = size;
+	fd -> clust = clust;
+	fd -> pos = (oflag & O_APPEND ? size : 0);
+	fd -> mode = oflag & (O_RDWR | O_WRONLY | O_RDONLY);
+	fd -> inuse = TRUE;
+
+	__h_getbuf(fd);
+
+	if (contig)
+	{
+		// The whole file is one run : no FAT access at all
+		fd -> complete = TRUE;
+		fd -> extents = 0;
+
+		if (clust >= 2 && size)
+		{
+			fd -> map[0].lba = clust2lba(clust);
+			fd -> map[0].end = (size + BLOCKSIZE - 1) / BLOCKSIZE;
+			fd -> extents = 1;
+		}
+	}
+	else
+		// Map the contiguous runs of the file so reads don't need the FAT
+		__h_map(fd);
+
+	__h_locate(fd, fd -> pos / BLOCKSIZE);
+}
+
+s8  close(u8 handle)
+									/* Close file handle
 										Parameter
 											handle	Handle referring to open file
 
@@ -699,6 +1489,8 @@ s8  close(u8 handle)
 
 	__files[handle].inuse = FALSE;
 
+	__h_putbuf(&(__files[handle]));
+
 #ifdef CCD_DEBUG
 	mprintf("close() OK");
 #endif
@@ -806,7 +1598,6 @@ s8  open(char *filename, u8 oflag, u8 pmode)
 	// Find a free handle
 	u8 handle = __h_findfree();
 	file_handle *fd = &(__files[handle]);
-	u32 curlba,next_lba;
 
 	// Check if file already exists
 	bool bexist;
@@ -815,6 +1606,8 @@ s8  open(char *filename, u8 oflag, u8 pmode)
 	mprintf("open(%s mode %d)\n\r",filename,oflag);
 #endif
 
+	fs_op(FS_OP_OPEN);
+
 	bexist = dir_findbyname(filename);
 
 	// If no more handle available then error EMFILE
@@ -824,7 +1617,7 @@ s8  open(char *filename, u8 oflag, u8 pmode)
 	if (bexist && (oflag & O_CREAT) && (oflag & O_EXCL)) return -1;
 
 	// If asked to truncate a file without write permission, error
-	if (bexist && (oflag & O_TRUNC) && (pde_cur -> Attr & ATTR_READ_ONLY)) return -1;
+	if (bexist && (oflag & O_TRUNC) && (de_cur.Attr & ATTR_READ_ONLY)) return -1;
 
 	// If asked to create or truncate, error
 	if ((oflag & O_CREAT) || (oflag & O_TRUNC)) return -1;
@@ -832,31 +1625,19 @@ s8  open(char *filename, u8 oflag, u8 pmode)
 	// Now we are left with O_APPEND, O_RDONLY, O_RDWR. File must exist.
 	if (!bexist) return -1;
 
+	// exFAT is mounted read only
+	if (hd1_exfat && !(oflag & O_RDONLY)) return -1;
+
 	// If asked for meaningless combinations of RDWR, WRONLY and RDONLY then error
 	if ((oflag & O_RDWR)	&& (oflag & O_RDONLY)) return -1;
 	if ((oflag & O_RDWR)	&& (oflag & O_WRONLY)) return -1;
 	if ((oflag & O_RDONLY)	&& (oflag & O_WRONLY)) return -1;
 
 	// Everything is OK, open file
-	fd -> size = peekl((u16)((char *)&pde_cur->FileSize - (char*)sector));
-	fd -> clust = peekw((u16)((char *)&pde_cur->FstClusLO - (char*)sector));
-	fd -> pos = (oflag & O_APPEND ? pde_cur -> FileSize : 0);
-	fd -> mode = oflag & (O_RDWR | O_WRONLY | O_RDONLY);
-	fd -> inuse = TRUE;
 	fd -> dirlba = lba_tmpdir;
 	fd -> dirptr = pde_cur;
-	fd -> curlba = clust2lba(fd -> clust);
 
-	// Scan for contigous clusters
-	curlba = fd->curlba;
-	fd->sector_rl=0;			
-	next_lba=clust_nextlba(curlba);
-	while(next_lba && (next_lba == curlba+1))
-	{
-		fd->sector_rl++;
-		curlba=next_lba;
-		next_lba=clust_nextlba(curlba);
-	}
+	__h_open(fd, de_clust(de_cur), de_cur.FileSize, oflag, de_contig);
 
 	return handle;
 }
@@ -884,8 +1665,8 @@ long  lseek(u8 handle, s32 offset, u8 origin)
 									*/
 {
 	file_handle *fd = &(__files[handle]);
-	u16 clust, clustcnt;
-	u8 secoff;
+
+	fs_op(FS_OP_LSEEK);
 
 	if (!(__h_in_use(handle)))	return -1;
 
@@ -917,21 +1698,8 @@ long  lseek(u8 handle, s32 offset, u8 origin)
 	// Update current pos
 	fd -> pos = offset;
 
-	// Calculate cluster / sector number of new pos
-	clustcnt =  offset / hd1_geom_clustsize;
-	secoff = (u8) ((offset % hd1_geom_clustsize) / (u32) BLOCKSIZE);
-
-	// Update current LBA
-	clust = fd -> clust;
-	while ((clustcnt--) && (clust < CLUSTCHAIN_END)) clust = clust_next(clust);
-
-	if (clust < CLUSTCHAIN_END)
-	{
-	
-		fd -> curlba = clust2lba(clust) + secoff;
-	}
-	else
-		fd->curlba = 0; // flag for extending chain
+	// Find the sector of new pos in the run map
+	__h_locate(fd, (u32) offset / BLOCKSIZE);
 
 	return offset;
 }
@@ -956,66 +1724,105 @@ s16  read(u8 handle, u8 *buffer, u16 count)
 	file_handle *fd = &(__files[handle]);
 
 	u16
-		offset_start = (u16) (fd -> pos & (BLOCKSIZE-1)),
+		offset_start,
 		u8s_read = 0,
 		u8s_toread,
-		u8s_leftinsec;
+		u8s_leftinsec,
+		run;
+	u8 *buf;
+
+	fs_op(FS_OP_READ);
 
 	if (!(__h_in_use(handle)))	return -1;
 
 	// If asked to read from a non read file then error
 	if (!((fd -> mode & O_RDWR) || (fd -> mode & O_RDONLY)))	return -1;
 
-	while ((u8s_read < count) && !(eof(handle)))
+	// Don't read past the end of file
+	if (fd -> pos >= fd -> size) return 0;
+
+	count = (u16) min((u32) count, fd -> size - fd -> pos);
+
+	while ((u8s_read < count) && (fd -> curlba))
 	{
-		// Read in the file current sector
-		sec_get(&(fd -> curlba));
+		offset_start = (u16) (fd -> pos & (BLOCKSIZE-1));
 
-		// 1 - calculate how many u8s are left in the current sector
-		u8s_leftinsec = BLOCKSIZE - offset_start;
+		// Whole sectors go straight to the user buffer, as long a run as is contiguous
+		if (!offset_start && (count - u8s_read >= BLOCKSIZE))
+		{
+			run = (u16) min(fd -> sector_rl + 1, (u32) ((count - u8s_read) / BLOCKSIZE));
 
-		// 2 - calculate how many u8s we can thus read in the current sector
-		u8s_toread = min(count - u8s_read, u8s_leftinsec);
+			if (!(mmc_MultiSectorRead(buffer + u8s_read, fd -> curlba, run))) break;
 
+			fs_op_sectors(run);
 
-		// 3 - read these u8s in the user buffer
-		memcpy(buffer+u8s_read, sector+offset_start,u8s_toread);
+			u8s_read += run * BLOCKSIZE;
+			fd -> pos += (u32) run * BLOCKSIZE;
 
-		// 4 - increment the read u8s counter
-		u8s_read += u8s_toread;
+			__h_advance(fd, run);
+			continue;
+		}
 
-		// 5 - if necessary go to next sector
-		if (u8s_toread == u8s_leftinsec)
+		// Unaligned head or partial tail : go through the file's own buffer, or else the sector cache
+
+		// 1 - Read in the file current sector
+		if (fd -> buf)
 		{
-			if(fd->sector_rl)
-			{	 
-				fd->sector_rl--;
-				fd->curlba++;
-			}
-			else
+			if (fd -> buflba != fd -> curlba)
 			{
-			    
-				fd -> curlba = clust_nextlba(fd -> curlba);
+				fd -> buflba = -1;
+
+				if (!(mmc_SectorRead(fd -> buf, fd -> curlba))) break;
+
+				fs_op_sectors(1);
+
+				fd -> buflba = fd -> curlba;
 			}
+
+			buf = fd -> buf;
+		}
+		else
+		{
+			sec_get(&(fd -> curlba));
+
+			buf = sector;
 		}
 
-		// 6 - zero offset_start, which is only useful in 1st pass
-		offset_start = 0;
-	}
+		// 2 - calculate how many u8s are left in the current sector
+		u8s_leftinsec = BLOCKSIZE - offset_start;
+
+		// 3 - calculate how many u8s we can thus read in the current sector
+		u8s_toread = min(count - u8s_read, u8s_leftinsec);
 
-	// Adjust file pos
-	fd -> pos += u8s_read;
+		// 4 - read these u8s in the user buffer
+		memcpy(buffer+u8s_read, buf+offset_start,u8s_toread);
+
+		// 5 - increment the read u8s counter and file pos
+		u8s_read += u8s_toread;
+		fd -> pos += u8s_toread;
+
+		// 6 - if necessary go to next sector
+		if (u8s_toread == u8s_leftinsec)
+			__h_advance(fd, 1);
+	}
 
 	return u8s_read;
 }
 
 //
 // read N sectors. file position must be aligned on sector offset
+// poll_fn (if not NULL) is called while the card transfers data. If it returns
+// non-zero the read is abandoned after the transfer in flight and -1 is returned
 // 
-s16 read_sectors(u8 handle,u8 *buffer,u16 sectors)
+s16 read_sectors(u8 handle,u8 *buffer,u16 sectors,int (*poll_fn)())
 {
 	file_handle *fd = &(__files[handle]);
-   	u16 actual;
+   	u16 actual,run;
+	u32 left;
+	s8 rc;
+	bool aborted=FALSE;
+
+	fs_op(FS_OP_READ_SECTORS);
 
 	if (!(__h_in_use(handle)))	return -1;
 
@@ -1028,70 +1835,488 @@ s16 read_sectors(u8 handle,u8 *buffer,u16 sectors)
 
 	while(!eof(handle) && sectors!=0)
 	{
-	  mmc_SectorRead(buffer,fd -> curlba);	   	
-
-	  fd->pos+=512;
-  	  buffer+=512;
-	  sectors--;
-	  actual++;
-
-	  if(fd->sector_rl)
-			{	 
-      		
-				fd->sector_rl--;
-				fd->curlba++;
-			}
-			else
-			{
-			    
-				fd -> curlba = clust_nextlba(fd -> curlba);
-			}
+	  // Sectors up to the end of the physically contiguous run
+	  run = (u16) min(fd->sector_rl + 1, (u32) sectors);
+
+	  // Don't read past the last sector of the file
+	  left = (fd->size - fd->pos + 511) >> 9;
+	  run = (u16) min(left, (u32) run);
+
+	  if(!mmc_ReadStart(buffer,fd -> curlba,run))
+	  	break;
+
+	  // Overlap the transfer with the caller's polling
+	  while(MMC_BUSY == (rc = mmc_ReadPoll()))
+	  {
+	  	if(poll_fn != NULL && poll_fn())
+		{
+			aborted=TRUE;
+			rc=mmc_ReadFinish();
+			break;
+		}
+	  }
+
+	  if(rc != MMC_DONE)
+	  	break;
+
+	  fs_op_sectors(run);
+
+	  fd->pos+=(u32) run << 9;
+  	  buffer+=(u32) run << 9;
+	  sectors-=run;
+	  actual+=run;
+
+	  __h_advance(fd, run);
+
+	  if(aborted)
+	  	return -1;
    }
 
 	return actual;	  
 }
 
+//
+//
+// ****************** LV5 - T R A C K   C A T A L O G ******************
+//
+//
+// Built once at mount, so track and directory changes need no directory scans
+// and tracks are opened straight from their 1st cluster
+
+// The catalog is also saved to CATALOG.BIN in the root directory, packed : the
+// used entries of dir and first are followed by the tracks. It is read straight
+// back at boot if the card is unchanged
+
+#ifdef FLAC_DECODER
+#define CATALOG_MAGIC	0x364C5443	// "CTL6", as CTL5 with .FLA tracks listed
+#else
+#define CATALOG_MAGIC	0x354C5443	// "CTL5", as CTL3 packed
+#endif
+
+typedef struct
+{
+	u32 magic;			// CATALOG_MAGIC
+	u32 image_size;		// sizeof(catalog), so builds with other limits reject the file
+	u32 volid;			// volume serial number
+	u32 lba_rd;			// root directory 1st sector
+	u32 lba_data;		// data area 1st sector (end of root directory)
+	u32 crc;			// CRC of the used root directory sectors and 1st subdirectory clusters
+
+	u16 dirs;			// count of subdirectories
+	u16 tracks;			// count of tracks
+
+	// Directory 0 is the root directory, followed by its subdirectories in directory order
+	catalog_entry dir[CATALOG_MAX_DIRS + 1];
+	u16 first[CATALOG_MAX_DIRS + 2];		// index of 1st track of each directory in track
+	catalog_entry track[CATALOG_MAX_TRACKS];
+} catalog;
+
+#define CATALOG_SECTORS	((sizeof(catalog) + BLOCKSIZE - 1) / BLOCKSIZE)
+
+static union
+{
+	catalog c;
+	u8 raw[CATALOG_SECTORS][BLOCKSIZE];
+} cat __attribute__((aligned(4)));
+
+#define cat_dir		cat.c.dir
+#define cat_track	cat.c.track
+#define cat_first	cat.c.first
+#define cat_dirs	cat.c.dirs
+#define cat_tracks	cat.c.tracks
+
+static char catalog_name[] = "CATALOG.BIN";
+
+// Directory entries looked at per catalog_step()
+#ifndef CATALOG_SLICE
+#define CATALOG_SLICE	16
+#endif
+
+// Indexing progress : -1 while listing the subdirectories, then the directory whose
+// tracks are being listed. Directories below cat_phase are complete
+static s16 cat_phase = 1;
+static dir_iter cat_it;		// walk of the directory being indexed
+
+// Is a dirent a playable track
+static bool  __is_track(dirent *de)
+{
+	if (de -> Attr == ATTR_LONG_NAME || (de -> Attr & ATTR_DIRECTORY))
+		return FALSE;
+
+#ifdef FLAC_DECODER
+	if (!strncmp("FLA", &(de -> Name[8]), 3))
+		return TRUE;
+#endif
+
+	return !strncmp("WAV", &(de -> Name[8]), 3);
+}
+
+static void  __cat_add(catalog_entry *entry, dir_iter *it)
+{
+	memcpy(entry -> name, it -> de.Name, 11);
+	entry -> clust = de_clust(it -> de);
+	entry -> size = it -> de.FileSize;
+	entry -> flags = it -> contig ? CATALOG_CONTIG : 0;
+}
+
+// Convert a padded 8.3 name back to standard filename convention
+static void  __name_from_83(char *filename, const char *name83)
+{
+	int i,j;
+
+	for (i = 8; i > 0 && name83[i - 1] == ' '; i--);
+
+	memcpy(filename, name83, i);
+	filename[i++] = '.';
+
+	for (j = 8; j < 11 && name83[j] != ' '; j++)
+		filename[i++] = name83[j];
+
+	filename[i] = 0;
+}
+
+//
+// start indexing the root directory and every subdirectory of it into the catalog
+//
+void catalog_start(void)
+{
+	cat_dirs = cat_tracks = 0;
+	cat_first[0] = cat_first[1] = 0;
+
+	memcpy(cat_dir[0].name, "TOP        ", 11);
+	cat_dir[0].clust = 0;
+	cat_dir[0].size = 0;
+	cat_dir[0].flags = 0;
+
+	cat_phase = -1;
+	dir_open(&cat_it, NULL);
+}
+
+//
+// index the next slice of the card. Return TRUE once the catalog is complete
+//
+bool catalog_step(void)
+{
+	u8 n;
+
+	if (cat_phase > (s16) cat_dirs)
+		return TRUE;
+
+	fs_op(FS_OP_SCAN);
+
+	for (n = 0 ; n < CATALOG_SLICE ; n++)
+	{
+		if (!dir_read(&cat_it, FILE_USED))
+		{
+			// Directory done, go on with the tracks of the next one
+			cat_first[++cat_phase] = cat_tracks;
+
+			if (cat_phase > (s16) cat_dirs)
+				return TRUE;
+
+			dir_open(&cat_it, cat_phase ? &cat_dir[cat_phase] : NULL);
+		}
+		else if (cat_phase < 0)
+		{
+			if ((cat_it.de.Attr & ATTR_DIRECTORY) && cat_dirs < CATALOG_MAX_DIRS)
+				__cat_add(&cat_dir[++cat_dirs], &cat_it);
+		}
+		else if (__is_track(&cat_it.de) && cat_tracks < CATALOG_MAX_TRACKS)
+			__cat_add(&cat_track[cat_tracks++], &cat_it);
+	}
+
+	return FALSE;
+}
+
+// Finish indexing up to directory d (-1 for the list of directories)
+static void  __cat_wait(s16 d)
+{
+	while (cat_phase <= d && !catalog_step());
+}
+
+//
+// scan the root directory and every subdirectory of it into the catalog
+//
+s16 catalog_build(void)
+{
+	catalog_start();
+
+	while (!catalog_step());
+
+	return cat_tracks;
+}
+
+static const u32 crc_nibble[16] =
+{
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+// Add n bytes to a CRC-32, a nibble at a time
+static u32  __cat_crc_add(u32 crc, const u8 *p, u16 n)
+{
+	while (n--)
+	{
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc_nibble[crc & 15];
+		crc = (crc >> 4) ^ crc_nibble[crc & 15];
+	}
+
+	return crc;
+}
+
+// CRC-32 of the root directory, up to the sector holding its end marker. Adding,
+// removing or renaming a track or a directory of the root changes its entries, or
+// their write stamps. On FAT the catalog file is found on the way : its 1st cluster
+// and size, clust is 0 if not found
+static u32  __cat_crc_root(u32 *clust, u32 *size)
+{
+	u32 crc = ~0, lba;
+	u16 i;
+	bool end = FALSE;
+	dir_iter it;
+
+	if (clust) *clust = 0;
+
+	dir_open(&it, NULL);
+
+	for (lba = it.dir ; lba && !end ; lba = dir_nextlba(&it, lba))
+	{
+		sec_get(&lba);
+
+		for (i = 0 ; i < BLOCKSIZE && !end ; i += 32)
+		{
+			// an entry starting with 0 ends the directory
+			if (sector[i] == DE_FREE_LAST)
+				end = TRUE;
+			else if (clust && !hd1_exfat && !memcmp(sector + i, "CATALOG BIN", 11))
+			{
+				*clust = (hd1_fat32 ? (u32) peekw(i + 20) << 16 : 0) | peekw(i + 26);
+				*size = peekl(i + 28);
+			}
+		}
+
+		crc = __cat_crc_add(crc, sector, BLOCKSIZE);
+	}
+
+	return crc;
+}
+
+// Bytes of the catalog packed
+static u16  __cat_packed(void)
+{
+	return (u8 *) &cat_dir[cat_dirs + 1] - cat.raw[0] + (cat_dirs + 2) * sizeof(u16) + cat_tracks * sizeof(catalog_entry);
+}
+
+// Move first and track up to the used entries of dir, or back
+static void  __cat_pack(bool pack)
+{
+	u8 *first = (u8 *) &cat_dir[cat_dirs + 1];
+	u8 *track = first + (cat_dirs + 2) * sizeof(u16);
+
+	if (pack)
+	{
+		memmove(first, cat_first, (cat_dirs + 2) * sizeof(u16));
+		memmove(track, cat_track, cat_tracks * sizeof(catalog_entry));
+	}
+	else
+	{
+		memmove(cat_track, track, cat_tracks * sizeof(catalog_entry));
+		memmove(cat_first, first, (cat_dirs + 2) * sizeof(u16));
+	}
+}
+
+// Finish the CRC of the root directory with the 1st cluster of each catalogued
+// subdirectory, whose own sectors are not read
+static u32  __cat_crc(u32 crc)
+{
+	u16 d;
+
+	for (d = 1 ; d <= cat_dirs ; d++)
+		crc = __cat_crc_add(crc, (u8 *) &cat_dir[d].clust, 4);
+
+	return ~crc;
+}
+
+//
+// load the catalog saved on the card. Return FALSE if missing or out of date
+//
+bool catalog_load(void)
+{
+	u32 crc, clust, size;
+	u8 handle;
+	s16 n, sectors;
+
+	dir_chdir(NULL);
+
+	// The pass taking the CRC of the root also finds the catalog, no name search
+	crc = __cat_crc_root(&clust, &size);
+
+	if (clust)
+	{
+		if ((handle = __h_findfree()) >= MAX_FILES) return FALSE;
+
+		__files[handle].dirlba = 0;
+		__files[handle].dirptr = NULL;
+
+		__h_open(&(__files[handle]), clust, size, O_RDONLY, FALSE);
+	}
+	else if (!hd1_exfat || (s8) (handle = open(catalog_name, O_RDONLY, 0)) < 0)
+		return FALSE;
+
+	// The header, then only the sectors of the used entries
+	n = sectors = read_sectors(handle, cat.raw[0], 1, NULL);
+
+	if (n == 1 && cat_dirs <= CATALOG_MAX_DIRS && cat_tracks <= CATALOG_MAX_TRACKS)
+	{
+		sectors = (__cat_packed() + BLOCKSIZE - 1) / BLOCKSIZE;
+
+		if (sectors > 1)
+			n += read_sectors(handle, cat.raw[1], sectors - 1, NULL);
+	}
+
+	close(handle);
+
+	if (n != sectors
+		|| cat.c.magic != CATALOG_MAGIC
+		|| cat.c.image_size != sizeof(catalog)
+		|| cat.c.volid != hd1_volid
+		|| cat.c.lba_rd != lba_rd
+		|| cat.c.lba_data != lba_data
+		|| cat.c.dirs > CATALOG_MAX_DIRS
+		|| cat.c.tracks > CATALOG_MAX_TRACKS
+		|| cat.c.crc != __cat_crc(crc))
+	{
+		cat_dirs = cat_tracks = 0;
+		cat_first[0] = cat_first[1] = 0;
+		cat_phase = 1;
+		return FALSE;
+	}
+
+	__cat_pack(FALSE);
+
+	cat_phase = cat_dirs + 1;
+
+	return TRUE;
+}
+
+//
+// save the catalog to the card, creating CATALOG.BIN if needed
+//
+bool catalog_save(void)
+{
+	s8 handle;
+	file_handle *fd;
+	u16 i, sectors;
+	u32 clust, clusters;
+
+	fs_op(FS_OP_SAVE);
+
+	// exFAT is mounted read only
+	if (hd1_exfat) return FALSE;
+
+	dir_chdir(NULL);
+
+	// Replace a catalog file too small for this build
+	if (dir_findbyname(catalog_name) && de_cur.FileSize < sizeof(cat.raw))
+	{
+		pde_cur -> Name[0] = DE_FREE;
+
+		if (!(sec_write(lba_tmpdir, sector))) return FALSE;
+
+		name_index_dir = 0;
+
+		clust_free(de_clust(de_cur));
+	}
+
+	if ((handle = open(catalog_name, O_RDWR, 0)) < 0)
+	{
+		// Create it in the root directory, as a single run of clusters
+		clusters = (sizeof(cat.raw) + hd1_geom_clustsize - 1) / hd1_geom_clustsize;
+
+		if (!(dir_examine(FILE_FREE))) return FALSE;
+
+		if (!(clust = clust_alloc(clusters))) return FALSE;
+
+		// The FAT updates may have evicted the directory sector
+		sec_get(&lba_tmpdir);
+		pde_cur = (dirent *) sector + de_index;
+
+		memset(pde_cur, 0, sizeof(dirent));
+		memcpy(pde_cur -> Name, "CATALOG BIN", 11);
+		pde_cur -> Attr = ATTR_ARCHIVE;
+		pde_cur -> FstClusLO = (u16) clust;
+		pde_cur -> FstClusHI = (u16) (clust >> 16);
+		pde_cur -> FileSize = sizeof(cat.raw);
+
+		if (!(sec_write(lba_tmpdir, sector))) return FALSE;
+
+		name_index_dir = 0;
+
+		if ((handle = open(catalog_name, O_RDWR, 0)) < 0)
+			return FALSE;
+	}
+
+	// Validation data is taken once the root directory holds the file
+	cat.c.magic = CATALOG_MAGIC;
+	cat.c.image_size = sizeof(catalog);
+	cat.c.volid = hd1_volid;
+	cat.c.lba_rd = lba_rd;
+	cat.c.lba_data = lba_data;
+	cat.c.crc = __cat_crc(__cat_crc_root(NULL, NULL));
+
+	fd = &(__files[handle]);
+	sectors = (__cat_packed() + BLOCKSIZE - 1) / BLOCKSIZE;
+
+	__cat_pack(TRUE);
+
+	for (i = 0 ; i < sectors ; i++)
+	{
+		if (!(fd -> curlba) || !(sec_write(fd -> curlba, cat.raw[i])))
+			break;
+
+		__h_advance(fd, 1);
+	}
+
+	__cat_pack(FALSE);
+
+	close(handle);
+
+	dir_chdir(NULL);
+
+	return i == sectors;
+}
+
 //
 // count number of directories, or seek to a particular directory index
 //
 s16 scan_dirs(int no,char *dirname)
 {
-	s16 count=0;
+	fs_op(FS_OP_SCAN);
 
 	// back to root directory
-	lba_curdir = lba_rd;
+	dir_chdir(NULL);
 	strcpy(dirname,"TOP");
 
 	if(!no)
 		return 0;
 
-	if (dir_examine(FILE_USED))
+	// the list of directories must be complete
+	__cat_wait(-1);
+
+	if(no < 0 || no > cat_dirs)
+		return cat_dirs;
+
+	if(dirname!=NULL)
 	{
-	
-		do
-		{
-				if(de_cur.Attr & ATTR_DIRECTORY)
-				{
-					if(++count==no)
-					{
-						if(dirname!=NULL)
-						{
- 							memcpy(dirname,&de_cur.Name[0],11);
-							dirname[11]=0;
-						}
-
-						// change current directory
-						lba_curdir = clust2lba(peekw((u16)((char *)&pde_cur->FstClusLO - (char*)sector)));
-
-						return count;
-					}
-				}
-		
-		}
-		while (dir_next(FILE_USED));
+		memcpy(dirname,cat_dir[no].name,11);
+		dirname[11]=0;
 	}
 
-  	return count;
+	// change current directory
+	dir_chdir(&cat_dir[no]);
+
+	return no;
 }
 
 //
@@ -1099,52 +2324,56 @@ s16 scan_dirs(int no,char *dirname)
 //
 s16 scan_tracks(int dirno,int fileno,char *filename,char *dirname)
 {
-	s16 count=0;
-	int i;
+	s16 count;
 
 	// scan to appropriate directory
 	if(scan_dirs(dirno,dirname)!=dirno)	
 	{
 			return -1; // not found
 	}
-	
-	if (dir_examine(FILE_USED))
-	{
-		do
-		{
-			if (de_cur.Attr != ATTR_LONG_NAME && (!(de_cur.Attr & ATTR_DIRECTORY)))
-			{
-				if(!strncmp("WAV", &de_cur.Name[8], 3))
-				{
-					if(++count == fileno)
-					{
-					 if(filename!=NULL)
-					 {
-					    memcpy(filename, &de_cur.Name[0], 11);
-					    filename[11]=0;
-
-					    // convert name back to standard filename convention
-					    for(i=7; i>0; i--)
-						{
-							if(filename[i]!=' ')
-								break;
-						}
-		
-						filename[i+1]=0;
-		
-						strcat(filename, ".WAV");
 
-					 }
-					 return count;
-					}		
-				}
-			}
-		}
-		while (dir_next(FILE_USED));
-	}
+	// and so must be its tracks
+	__cat_wait(dirno);
+
+	count = cat_first[dirno+1] - cat_first[dirno];
+
+	if(fileno < 1 || fileno > count)
+		return count;
+
+	if(filename!=NULL)
+		__name_from_83(filename, cat_track[cat_first[dirno] + fileno - 1].name);
+
+	return fileno;
+}
+
+//
+// open a track of the catalog for reading, without any directory search
+//
+s8 open_track(int dirno,int fileno)
+{
+	u8 handle = __h_findfree();
+	catalog_entry *track;
 
-	return count;
-   	
+	fs_op(FS_OP_OPEN);
+
+	if (handle >= MAX_FILES) return -1;
+
+	__cat_wait(-1);
+
+	if (dirno < 0 || dirno > cat_dirs) return -1;
+
+	__cat_wait(dirno);
+
+	if (fileno < 1 || fileno > cat_first[dirno+1] - cat_first[dirno]) return -1;
+
+	track = &cat_track[cat_first[dirno] + fileno - 1];
+
+	__files[handle].dirlba = 0;
+	__files[handle].dirptr = NULL;
+
+	__h_open(&(__files[handle]), track -> clust, track -> size, O_RDONLY, track -> flags & CATALOG_CONTIG);
+
+	return handle;
 }
 
 #endif
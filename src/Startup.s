@@ -43,14 +43,41 @@
 //   </h>
 // </h>
 */
-        .equ    Top_Stack,      0x40004000
+        .equ    Top_Stack,      0x40008000
         .equ    UND_Stack_Size, 0x00000004
         .equ    SVC_Stack_Size, 0x00000004
         .equ    ABT_Stack_Size, 0x00000004
-        .equ    FIQ_Stack_Size, 0x00000004
+        .equ    FIQ_Stack_Size, 0x00000080
         .equ    IRQ_Stack_Size, 0x00000100
         .equ    USR_Stack_Size, 0x00000400
 
+# Lowest stack address. Target.ld checks that static data ends below it and
+# sbrk() in syscalls.c keeps the heap under it
+        .equ    Stack_Limit,    Top_Stack - UND_Stack_Size - SVC_Stack_Size - ABT_Stack_Size - FIQ_Stack_Size - IRQ_Stack_Size - USR_Stack_Size
+        .global Stack_Limit
+
+
+/*
+// <e> Sample Output FIQ
+// <i> Timer 0 sample output on FIQ, see init_timing() in Timing.c
+//   <o1>   DAC
+//               <1=> Internal 10-bit DAC (INTERNAL_DAC defined in Timing.h)
+//               <0=> TLV320DAC23 on SSP
+// </e>
+*/
+        .equ    FIQ_SETUP,      1
+        .equ    FIQ_INTERNAL_DAC, 1
+
+# Target.ld checks FIQ_INTERNAL_DAC against DAC_INTERNAL, set by Timing.c from
+# INTERNAL_DAC, so a mismatch fails the link
+        .global FIQ_INTERNAL_DAC
+
+        .equ    DACR_ADDR,      0xE006C000  /* DAC Register */
+        .equ    SSPDR_ADDR,     0xE0068008  /* SSP Data Register */
+        .equ    T0IR_ADDR,      0xE0004000  /* Timer 0 Interrupt Register */
+        .equ    IOSET0_ADDR,    0xE0028004  /* GPIO 0 Set Register (IOCLR0 is 8 above) */
+        .equ    LRCLK_PIN,      (1<<20)     /* P0.20 is the LRCLK */
+
 
 # VPBDIV definitions
         .equ    VPBDIV,         0xE01FC100  /* VPBDIV Address */
@@ -243,7 +270,67 @@ SWI_Handler:    B       SWI_Handler
 PAbt_Handler:   B       PAbt_Handler
 DAbt_Handler:   B       DAbt_Handler
 IRQ_Handler:    B       IRQ_Handler
+
+.if FIQ_SETUP
+
+# Sample Output FIQ Handler
+#  Banked registers hold the output state between interrupts
+#   R8  = next sample (DACR halfword for the internal DAC), 0 while outputting silence
+#   R9  = interrupts left until the end of the block
+#   R10 = DAC data register
+#   R11 = T0IR
+#   R12 = last output, faded to silence without a block (DACR value for the
+#         internal DAC, both channels for the external DAC with the one output
+#         next in the low half)
+#  At the end of a block fiq_next_block() in Timing.c returns the next one
+
+FIQ_Handler:    STMFD   SP!, {R0, R1}
+.if FIQ_INTERNAL_DAC
+#  Blocks hold ready made DACR values (see commit_buffer())
+                CMP     R8, #0
+                LDRNEH  R12, [R8], #2
+                SUBEQ   R0, R12, #0x8000
+                SUBEQ   R12, R12, R0, ASR #4
+                STR     R12, [R10]
+.else
+#  Toggle LRCLK according to sample
+                MOV     R1, #LRCLK_PIN
+                LDR     R0, =IOSET0_ADDR
+                TST     R9, #1
+                ADDEQ   R0, R0, #8
+                STR     R1, [R0]
+#  Load 16-bit sample into output FIFO.. this starts transmission
+                MOV     R0, R12, LSL #16
+                MOV     R0, R0, ASR #16
+                CMP     R8, #0
+                LDRNESH R0, [R8], #2
+                SUBEQ   R0, R0, R0, ASR #4
+                STR     R0, [R10]
+                MOV     R12, R12, LSR #16
+                ORR     R12, R12, R0, LSL #16
+.endif
+#  Clear interrupt flag
+                MOV     R0, #1
+                STR     R0, [R11]
+                SUBS    R9, R9, #1
+                LDMNEFD SP!, {R0, R1}
+                SUBNES  PC, LR, #4
+
+#  End of block : R0-R3, R12 and LR are not preserved by C functions
+                STMFD   SP!, {R2, R3, R12, LR}
+                LDR     R0, =fiq_next_block
+                MOV     LR, PC
+                BX      R0
+                MOV     R8, R0
+                LDR     R9, =fiq_block_ticks
+                LDR     R9, [R9]
+                LDMFD   SP!, {R2, R3, R12, LR}
+                LDMFD   SP!, {R0, R1}
+                SUBS    PC, LR, #4
+
+.else
 FIQ_Handler:    B       FIQ_Handler
+.endif
 
 
 # Reset Handler
@@ -359,6 +446,23 @@ PLL_Loop:       LDR     R3, [R0, #PLLSTAT_OFS]
                 MOV     SP, R0
                 SUB     R0, R0, #FIQ_Stack_Size
 
+.if FIQ_SETUP
+#  Initial output state : silence, asking for a block at the 1st interrupt
+                MOV     R8, #0
+                MOV     R9, #1
+.if FIQ_INTERNAL_DAC
+                LDR     R10, =DACR_ADDR
+.else
+                LDR     R10, =SSPDR_ADDR
+.endif
+                LDR     R11, =T0IR_ADDR
+.if FIQ_INTERNAL_DAC
+                MOV     R12, #0x8000
+.else
+                MOV     R12, #0
+.endif
+.endif
+
 #  Enter IRQ Mode and set its Stack Pointer
                 MSR     CPSR_c, #Mode_IRQ|I_Bit|F_Bit
                 MOV     SP, R0
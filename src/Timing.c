@@ -12,91 +12,137 @@
 #include <LPC213X.H>                          // LPC21XX Peripheral Registers
 #include "timing.h"
 #include "types.h"
+#include "serial.h"
+#include <stdio.h>
 #include <string.h>
 
-// define this to use inbuilt 10-bit DAC, otherwise use the TLV320DAC23
-#define INTERNAL_DAC
-
 // P0.20 is the LRCLK
 #define LRCLK_PIN (1L<<20)
 
 static volatile u32 timeval;
 static u16 ticks_per_sec;
    
-// double sample buffers	
-static s16 buffer0[BUFSIZE],buffer1[BUFSIZE],*p;
-// current read counter
-static u16 cnt=BUFSIZE;
+#if AUDIO_BLOCKS & (AUDIO_BLOCKS - 1)
+#error AUDIO_BLOCKS must be a power of 2
+#endif
+
+// ring of sample blocks, word aligned for the card receive kernel. The main loop fills
+// block head and the interrupt plays block tail. Each index is only written by its side
+static s16 ring[AUDIO_BLOCKS][BUFSIZE] __attribute__((aligned(4)));
+static volatile u8 head,tail;
+// output started (prefill reached), and playing out the last blocks
+static volatile bool running,draining;
+// block being output, NULL while outputting silence
+static s16 *p;
 // current sample rate
 static int CurrentHz=0;
-static volatile u16 buffer_done=0,buffer_active=0;
 
-/* Timer Counter 0 Interrupt executes nominally at 44100 Hz or 88200 Hz for external DAC */
+// blocks queued for output
+#define queued()	((u8)(head - tail))
 
-static void tc0 (void) __attribute__ ((interrupt));
+// samples per block
+#define BLOCK_SAMPLES	(BUFSIZE>>1)
 
-static void tc0 (void)
-{
-#ifdef INTERNAL_DAC
-	static s16 x;
-
-	// combine left and right channel for mono output
-	x=(*p++ ) >> 1 ;
-	x+=(*p++) >> 1;
-   DACR		  = 32768+x;
-			
-  if(!--cnt)
-  {
-    // swap buffers
-  	cnt=BUFSIZE>>1;
-	buffer_active ^= 1;
-	if(!buffer_active)
-		p=buffer0;
-	else
-		p=buffer1;
-	buffer_done=1;
-	timeval++;
-  }
-   		
+// DAC outputs per sample
+#ifdef DAC_NOISE_SHAPING
+#define DAC_RATE_SHIFT	1
 #else
+#define DAC_RATE_SHIFT	0
+#endif
 
-  // Toggle LRCLK according to sample
-  if(cnt & 1)
-  	IOSET0 = LRCLK_PIN;
-  else
-    IOCLR0 = LRCLK_PIN;
+// underrun telemetry
+static audio_stats stats;
+static u16 track_dir,track_no;			// track being queued
+static u32 played;						// samples output since the track started
+static audio_xrun *xrun;				// underrun in progress, NULL if none
 
-  // Load 16-bit sample into output FIFO.. this starts transmission
-  SSPDR	 = *p++;
+// End of a block : release the block played and move on to the next queued one.
+// Finding none while running is an underrun, which lasts until a block is queued
+static void next_block(void)
+{
+	if(p)
+	{
+		tail++;
+		played+=BLOCK_SAMPLES;
+		stats.blocks++;
+	}
 
-  // Count down and swap over buffers at end				
-  if(!--cnt)
-  {
-    // swap buffers
-  	cnt=BUFSIZE;
-	buffer_active ^= 1;
-	if(!buffer_active)
-		p=buffer0;
-	else
-		p=buffer1;
-	buffer_done=1;
+	p = (running && queued()) ? ring[tail & (AUDIO_BLOCKS-1)] : NULL;
+
+	if(p || !running || draining)
+	{
+		xrun=NULL;
+		return;
+	}
+
+	if(!xrun)
+	{
+		stats.underruns++;
+
+		xrun=&stats.log[stats.logged++ % AUDIO_XRUN_LOG];
+		xrun->dir=track_dir;
+		xrun->track=track_no;
+		xrun->position=played;
+		xrun->late=0;
+	}
+
+	xrun->late+=BLOCK_SAMPLES;
+	stats.silent+=BLOCK_SAMPLES;
+
+	if(xrun->late > stats.max_late)
+		stats.max_late=xrun->late;
+}
+
+/* Timer Counter 0 FIQ executes nominally at 44100 Hz or 88200 Hz for external DAC.
+   The per-sample output is FIQ_Handler in Startup.s, which must be set up for the
+   same DAC (FIQ_INTERNAL_DAC). It keeps its state in banked registers and only
+   calls fiq_next_block() at the end of each block. The DAC built for is published
+   as DAC_INTERNAL, which Target.ld checks against FIQ_INTERNAL_DAC */
+
+#ifdef INTERNAL_DAC
+// interrupts per block : one per DACR halfword, one or two per stereo sample
+const u32 fiq_block_ticks = BLOCK_SAMPLES<<DAC_RATE_SHIFT;
+__asm__(".global DAC_INTERNAL\n.equ DAC_INTERNAL, 1");
+#else
+// one per channel
+const u32 fiq_block_ticks = BUFSIZE;
+__asm__(".global DAC_INTERNAL\n.equ DAC_INTERNAL, 0");
+#endif
+
+// called by FIQ_Handler at the end of a block, returns the next block to output
+s16 *fiq_next_block(void)
+{
+	next_block();
 
 	// Timing function
 	timeval++;
-  }
-   		
-#endif
-      
 
-  T0IR        = 1;                            // Clear interrupt flag
-  VICVectAddr = 0xff;                            // Acknowledge Interrupt
-} 
+	return p;
+}
 
-// clear buffers to zero values
+// drop queued blocks, the interrupt outputting silence until output starts again.
+// FIQ_Handler still runs to the end of the block it is outputting, so wait for it to
+// take the next one (silence) before the ring is refilled from its 1st block
 void clear_buffers(void)
 {
-	memset(buffer0, 0, sizeof(buffer0));
-	memset(buffer1, 0, sizeof(buffer1));
+	u32 enabled = VICIntEnable & 0x10, t;
+	bool busy;
+
+	VICIntEnClr = 0x10;							// hold off Timer0 Interrupts
+
+	busy=(p!=NULL);
+	t=timeval;
+
+	running=draining=FALSE;
+	p=NULL;
+	head=tail=0;
+	played=0;
+	xrun=NULL;
+
+	VICIntEnable = enabled;
+
+	if(busy && enabled)
+		while(timeval==t) ;
 }
 
 // change the dac sampling rate based on a 60MHz clock
@@ -110,7 +156,7 @@ void set_dac_rate(int Hz)
   T0TCR = 2;                                  // Timer0 Disable & reset
 
 #ifdef INTERNAL_DAC
-	T0MR0 = 15000000L / Hz;	
+	T0MR0 = 15000000L / (Hz<<DAC_RATE_SHIFT);	
 	ticks_per_sec = (256*Hz) / (BUFSIZE>>1);
 #else
 	T0MR0 = 15000000L / (Hz<<1);	
@@ -144,7 +190,7 @@ void delay (int ticks)
   while ((mark() - i) < ticks);                  
 }
 
-// get free sample buffer	
+// get free sample block	
 s16 *get_buffer(int (*poll_fn)())
 {
 	do 
@@ -157,14 +203,200 @@ s16 *get_buffer(int (*poll_fn)())
 			return NULL;
 		}
 	}
-	while(!buffer_done) ;
-	
-	buffer_done=0;
+	while(queued() >= AUDIO_BLOCKS) ;
+
+	return ring[head & (AUDIO_BLOCKS-1)];
+}
+
+#ifdef INTERNAL_DAC
+
+// mono mix of a stereo sample (left in the low half)
+#define mono(w)		(((s16)(w) >> 1) + ((s32)(w) >> 17))
+
+#ifndef DAC_NOISE_SHAPING
+
+// mono DACR value of a stereo sample
+#define dacr(w)		((u32)(32768 + mono(w)))
+
+// convert a block of stereo samples in place to DACR halfwords, leaving the FIQ only a
+// load and a store per sample. Two samples are read and one word written at a time
+static void to_dacr(s16 *block)
+{
+	u32 *in=(u32 *)block,*out=(u32 *)block,a,b;
+	u16 n;
+
+	for(n=BLOCK_SAMPLES>>1;n;n--)
+	{
+		a=*in++;
+		b=*in++;
+		*out++ = dacr(a) | (dacr(b) << 16);
+	}
+}
+
+#else
+
+static s32 last;		// last mono sample, carried over to the next block
+static s32 e1,e2;		// quantisation errors of the last 2 outputs
+static u32 seed=1;		// dither generator
+
+// quantise x to the 10 DACR bits, adding triangular dither of +-1 LSB and feeding the
+// error back so its spectrum is shaped by (1 - z^-1)^2, away from the audio band
+static u32 shape(s32 x)
+{
+	s32 v;
+	u32 q;
+
+	seed = seed * 1664525 + 1013904223;
+
+	v = x - 2 * e1 + e2 + (s32)(seed >> 26) - (s32)((seed >> 20) & 63);
 
-	if(!buffer_active)
-		return buffer1;
-	else
-		return buffer0;
+	if(v < -32768)
+		v = -32768;
+	else if(v > 32767 - 32)
+		v = 32767 - 32;
+
+	q = (u32)(v + 32768 + 32) & 0xFFC0;
+
+	e2 = e1;
+	e1 = (s32)q - 32768 - v;
+
+	return q;
+}
+
+// convert a block of stereo samples in place to twice as many DACR halfwords. Each
+// sample is preceded by its linear interpolation with the previous one, so the two
+// outputs take the word the sample came from
+static void to_dacr(s16 *block)
+{
+	u32 *w=(u32 *)block,a;
+	s32 m;
+	u16 n;
+
+	for(n=BLOCK_SAMPLES;n;n--)
+	{
+		a=*w;
+		m=mono(a);
+		*w++ = shape((last + m) >> 1) | (shape(m) << 16);
+		last=m;
+	}
+}
+
+#endif
+
+// time the conversion of the 1st block of the ring
+static void bench_block(void)
+{
+	to_dacr(ring[0]);
+}
+
+// CPU cycles per stereo sample of to_dacr()
+u32 bench_output_stage(void)
+{
+	return time_cycles(bench_block) / BLOCK_SAMPLES;
+}
+
+#endif
+
+// CPU cycles taken by fn, timed by Timer 0 counting freely (PCLK is CCLK/4) while
+// output is stopped
+u32 time_cycles(void (*fn)(void))
+{
+	u32 enabled = VICIntEnable & 0x10, t;
+
+	clear_buffers();
+
+	VICIntEnClr = 0x10;							// hold off Timer0 Interrupts
+
+	T0MCR = 0;
+	T0TCR = 2;
+	T0TCR = 1;
+
+	fn();
+
+	t = T0TC;
+
+	T0TCR = 2;
+	T0MCR = 3;
+	T0IR = 1;
+	T0TCR = 1;
+
+	VICIntEnable = enabled;
+
+	return t * 4;
+}
+
+// queue the block returned by get_buffer(), starting output once prefilled
+void commit_buffer(void)
+{
+#ifdef INTERNAL_DAC
+	to_dacr(ring[head & (AUDIO_BLOCKS-1)]);
+#endif
+
+	head++;
+
+	if(queued() >= AUDIO_PREFILL)
+		running=TRUE;
+}
+
+// play out the queued blocks
+bool drain_buffers(int (*poll_fn)())
+{
+	draining=TRUE;
+	running=TRUE;
+
+	while(queued())
+	{
+		if(poll_fn())
+		{
+		    clear_buffers();
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+// name the track being queued
+void set_audio_track(u16 dir,u16 track)
+{
+	track_dir=dir;
+	track_no=track;
+}
+
+// copy out the output telemetry
+void get_audio_stats(audio_stats *s)
+{
+	memcpy(s,&stats,sizeof(stats));
+}
+
+void clear_audio_stats(void)
+{
+	memset(&stats,0,sizeof(stats));
+}
+
+// print the output telemetry, underrun positions in ms
+void dump_audio_stats(void)
+{
+	u32 i;
+	audio_xrun *x;
+
+	puts("Blocks ");		puts(itoa(stats.blocks,32));
+	puts(" Underruns ");	puts(itoa(stats.underruns,32));
+	puts(" Silent ");		puts(itoa(stats.silent,32));
+	puts("\n\rMax late ");	puts(itoa(stats.max_late,32));
+	puts(" samples\n\r");
+
+	for(i=stats.logged > AUDIO_XRUN_LOG ? stats.logged - AUDIO_XRUN_LOG : 0;i<stats.logged;i++)
+	{
+		x=&stats.log[i % AUDIO_XRUN_LOG];
+
+		puts(itoa(x->dir,8));		puts("/");
+		puts(itoa(x->track,16));	puts(" at ");
+		puts(itoa(CurrentHz ? (x->position / CurrentHz) * 1000 + ((x->position % CurrentHz) * 1000) / CurrentHz : 0,32));
+		puts(" late ");				puts(itoa(x->late,32));
+		puts("\n\r");
+	}
 }
 
 #define I2C_EN 64
@@ -236,8 +468,6 @@ static bool write_dac(u8 reg,u16 value)
 /* Setup the DAC/Timing Interrupt */
 void init_timing (void) 
 {
-	clear_buffers();
-
   // configure SPI1 for SPI CPOL=1 CPHA=0 16-bit format, maximum frequency
   SSPCR0 = 64|15;
   // maximum frequency 15 MHz (PCLK=60MHz/4)
@@ -275,25 +505,14 @@ void init_timing (void)
   IODIR0 |= LRCLK_PIN;
   IOCLR0 =LRCLK_PIN;
 
-	// set interrupt vector in 0
-	VICVectAddr0 = (unsigned long)tc0;          
-
-  buffer_active=0;
-  p=buffer0;
-#ifdef INTERNAL_DAC
-  cnt=BUFSIZE>>1;
-#else
-  cnt=BUFSIZE;
-#endif
-
-  buffer_done=1;
+  p=NULL;
 
   T0MCR = 3;                                  // Interrupt and Reset on MR0
 
   // default settings
   set_dac_rate(44100);
 	
-  VICVectCntl0 = 0x20 | 4;                    // use it for Timer 0 Interrupt
+  VICIntSelect |= 0x00000010;                  // Timer 0 Interrupt is a FIQ
 
   VICIntEnable |= 0x00000010;                  // Enable Timer0 Interrupts
  
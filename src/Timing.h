@@ -11,6 +11,14 @@
 
 #include "types.h"
 
+// define this to use inbuilt 10-bit DAC, otherwise use the TLV320DAC23. FIQ_INTERNAL_DAC
+// in Startup.s must match, the link fails otherwise
+#define INTERNAL_DAC
+
+// define this to output twice the sample rate to the inbuilt DAC, interpolated, with noise
+// shaped dither instead of truncation to 10 bits (check bench_output_stage() fits the rate)
+//#define DAC_NOISE_SHAPING
+
 extern void init_timing(void);
 
 // set sample frequency
@@ -25,13 +33,75 @@ void delay(int ticks);
    
 void delay_100ms(void);
 
-// size of output buffer. must be multiple of 512
-#define BUFSIZE 2048
+// size of a block of the output ring, in samples. must be multiple of 256 (whole sectors)
+#ifndef BUFSIZE
+#define BUFSIZE 1024
+#endif
+
+// count of blocks in the output ring (power of 2)
+#ifndef AUDIO_BLOCKS
+#define AUDIO_BLOCKS 4
+#endif
+
+// blocks filled before output starts
+#ifndef AUDIO_PREFILL
+#define AUDIO_PREFILL AUDIO_BLOCKS
+#endif
 	
-// get free sample buffer (double buffered) calling the designated polling function	
+// get a free block of the ring calling the designated polling function until there is one.
+// NULL if the polling function aborted
 s16 *get_buffer(int (*poll_fn)());
 
-// clear sample buffers
+// queue the block from get_buffer() for output. With the internal DAC the block is
+// converted in place to DACR values, so it must not be used afterwards
+void commit_buffer(void);
+
+// start output of whatever is queued and wait until it has been played. FALSE if the
+// polling function aborted
+bool drain_buffers(int (*poll_fn)());
+
+// drop queued blocks and output silence. Waits for the end of the block being output,
+// at most one block time, so the ring can be reused at once
 void clear_buffers(void);
 
+// Underruns kept in the log
+#define AUDIO_XRUN_LOG 8
+
+// An underrun : output started but found the ring empty at the end of a block
+typedef struct
+{
+	u16 dir,track;		// track playing (set_audio_track())
+	u32 position;		// samples output since the track started
+	u32 late;			// samples of silence output until a block was queued
+} audio_xrun;
+
+// Output telemetry
+typedef struct
+{
+	u32 blocks;			// blocks played
+	u32 underruns;		// count of underruns
+	u32 silent;			// samples of silence output during underruns
+	u32 max_late;		// longest underrun, in samples
+	u32 logged;			// underruns logged, the last AUDIO_XRUN_LOG are kept
+	audio_xrun log[AUDIO_XRUN_LOG];
+} audio_stats;
+
+// name the track being queued, for the underrun log
+void set_audio_track(u16 dir,u16 track);
+
+void get_audio_stats(audio_stats *stats);
+
+void clear_audio_stats(void);
+
+// print output telemetry on the serial port
+void dump_audio_stats(void);
+
+// CPU cycles taken by fn. Stops output
+u32 time_cycles(void (*fn)(void));
+
+#ifdef INTERNAL_DAC
+// CPU cycles per stereo sample taken by the block conversion for the DAC. Stops output
+u32 bench_output_stage(void);
+#endif
+
 #endif
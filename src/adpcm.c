@@ -0,0 +1,278 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  ADPCM.C:  IMA ADPCM decoder
+**
+**  IMA (DVI) ADPCM WAV files hold 4 bits per sample, a quarter of the card bandwidth
+**  of 16-bit PCM. Each block starts with the 16-bit sample and step index of each
+**  channel, followed by runs of 4 bytes per channel, 8 samples each, low nibble first.
+**  Blocks are read whole, with read_sectors() when they are sector aligned, and decoded
+**  a part at a time into the blocks of the output ring
+*/
+
+#include <stdio.h>
+#include "adpcm.h"
+#include "ffs.h"
+#include "timing.h"
+#include "types.h"
+
+// Decoder state of a channel, full words for ARM arithmetic
+typedef struct
+{
+	s32 sample;			// last sample
+	s32 index;			// index of the step size
+} adpcm_channel;
+
+// step sizes
+static const u16 step_table[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// step index change by code
+static const s8 index_table[16] =
+{
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static u8 *block;				// block being decoded, in the RAM lent to the decoder
+
+static u8 handle;
+static u8 channels;
+static bool sectors;			// blocks are read with read_sectors()
+static u16 block_align;
+static u32 left;				// bytes of sample data not read yet
+static u16 pos,avail;			// next sample of the block, samples in the block
+static adpcm_channel chan[2];
+static void (*decode)(u32 *out,u16 n);
+
+// next sample of a channel from its 4-bit code
+static inline s32 step(adpcm_channel *c,u32 code)
+{
+	s32 s,d;
+
+	code &= 15;
+
+	s = step_table[c->index];
+	d = s >> 3;
+
+	if(code & 4)
+		d += s;
+	if(code & 2)
+		d += s >> 1;
+	if(code & 1)
+		d += s >> 2;
+	if(code & 8)
+		d = -d;
+
+	d += c->sample;
+
+	if(d > 32767)
+		d = 32767;
+	else if(d < -32768)
+		d = -32768;
+
+	c->sample = d;
+
+	c->index += index_table[code];
+
+	if(c->index < 0)
+		c->index = 0;
+	else if(c->index > 88)
+		c->index = 88;
+
+	return d;
+}
+
+// A decoder is a loop specialised for mono or stereo, producing a stereo 16-bit word
+// from sample pos on of the block
+#define DECODER(name,stereo)											\
+static void name(u32 *out,u16 n)										\
+{																		\
+	const u8 *in;														\
+	u32 j,shift;														\
+	s32 l,r;															\
+																		\
+	for(;n;n--)															\
+	{																	\
+		j = pos++ - 1;													\
+		in = block + (4 << (stereo)) + ((j >> 3) << (2 + (stereo))) + ((j & 7) >> 1);	\
+		shift = (j & 1) << 2;											\
+																		\
+		l = step(&chan[0], *in >> shift);								\
+		r = (stereo) ? step(&chan[1], in[4] >> shift) : l;				\
+																		\
+		*out++ = (u16)l | ((u32)(u16)r << 16);							\
+	}																	\
+}
+
+DECODER(decode_mono,	0)
+DECODER(decode_stereo,	1)
+
+// samples in a block of so many bytes
+static u16 block_frames(u32 bytes)
+{
+	u32 header = (u32)channels << 2;
+
+	if(bytes <= header)
+		return 0;
+
+	return 1 + (((bytes - header) / header) << 3);
+}
+
+// start decoding the sample data at the position of handle
+u32 adpcm_start(adpcm_ram *ram,u8 fd,u16 nchannels,u16 align,u16 bits,u32 size)
+{
+	if(bits != 4 || nchannels < 1 || nchannels > 2)
+		return 0;
+
+	// whole runs of 4 bytes per channel, after the header
+	if(align > ADPCM_MAX_BLOCK || align <= (nchannels << 2) || (align & ((nchannels << 2) - 1)))
+		return 0;
+
+	block = ram->block;
+	handle = fd;
+	channels = nchannels;
+	block_align = align;
+	decode = channels == 2 ? decode_stereo : decode_mono;
+
+	// read blocks straight from the card if they lie on sector boundaries
+	sectors = !(align & 511) && !(lseek(fd, 0, SEEK_CUR) & 511);
+
+	left = size;
+	pos = avail = 0;
+
+	return (size / align) * block_frames(align) + block_frames(size % align);
+}
+
+// read the next block. FALSE at end of data, -1 on error or abort
+static s8 next_block(int (*poll_fn)())
+{
+	u16 bytes = left < block_align ? left : block_align;
+	s16 actual;
+	u8 c;
+
+	if(sectors)
+	{
+		actual = read_sectors(handle, block, (bytes + 511) >> 9, poll_fn);
+
+		if(actual >= 0 && ((u16)actual << 9) < bytes)
+			bytes = actual << 9;
+	}
+	else
+	{
+		actual = read(handle, block, bytes);
+
+		if(actual >= 0)
+			bytes = actual;
+	}
+
+	if(actual < 0)
+		return -1;
+
+	left -= bytes;
+
+	avail = block_frames(bytes);
+	if(!avail)
+		return FALSE;
+
+	// header of each channel : 1st sample, step index
+	for(c = 0; c < channels; c++)
+	{
+		chan[c].sample = (s16)(block[c << 2] | (block[(c << 2) + 1] << 8));
+		chan[c].index = block[(c << 2) + 2];
+
+		if(chan[c].index > 88)
+			chan[c].index = 88;
+	}
+
+	pos = 0;
+
+	return TRUE;
+}
+
+// decode up to frames samples into block
+s16 adpcm_read(s16 *out,u16 frames,int (*poll_fn)())
+{
+	u32 *w = (u32 *)out;
+	u16 done = 0,n;
+	s8 rc;
+
+	while(done < frames)
+	{
+		if(pos == avail)
+		{
+			rc = next_block(poll_fn);
+
+			if(rc < 0)
+				return -1;
+
+			if(!rc)
+				break;
+		}
+
+		// the header sample is played as is
+		if(pos == 0)
+		{
+			*w++ = (u16)chan[0].sample | ((u32)(u16)chan[channels - 1].sample << 16);
+			pos++;
+			done++;
+			continue;
+		}
+
+		n = avail - pos;
+		if(n > frames - done)
+			n = frames - done;
+
+		decode(w, n);
+
+		w += n;
+		done += n;
+	}
+
+	return done;
+}
+
+// decode a whole block, 32 samples at a time
+static void bench_block(void)
+{
+	u32 out[32];
+
+	for(pos = 1; pos < avail; )
+		decode(out, avail - pos < 32 ? avail - pos : 32);
+}
+
+// CPU cycles per stereo sample of the decoder, on a block of arbitrary codes. Stops
+// output and ends any decoding
+u32 bench_adpcm(adpcm_ram *ram)
+{
+	u16 i;
+
+	block = ram->block;
+
+	for(i = 0; i < ADPCM_MAX_BLOCK; i++)
+		block[i] = (u8)(i * 151 + 17);
+
+	channels = 2;
+	decode = decode_stereo;
+	avail = block_frames(ADPCM_MAX_BLOCK);
+	left = 0;
+
+	chan[0].sample = chan[1].sample = 0;
+	chan[0].index = chan[1].index = 40;
+
+	i = avail - 1;
+
+	return time_cycles(bench_block) / i;
+}
@@ -0,0 +1,37 @@
+#ifndef _ADPCM_H
+#define _ADPCM_H
+
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  IMA ADPCM decoder
+*/
+
+#include "types.h"
+
+// largest block (nBlockAlign) of the files played, in bytes. Its buffer is RAM
+#ifndef ADPCM_MAX_BLOCK
+#define ADPCM_MAX_BLOCK	2048
+#endif
+
+// RAM the decoder works in, lent by the player for the track
+typedef struct
+{
+	u8 block[ADPCM_MAX_BLOCK] __attribute__((aligned(4)));	// block being decoded
+} adpcm_ram;
+
+// start decoding the IMA ADPCM sample data at the position of handle, size bytes long,
+// in ram. Returns the count of samples in it, 0 if the format is not supported
+u32 adpcm_start(adpcm_ram *ram,u8 handle,u16 channels,u16 block_align,u16 bits,u32 size);
+
+// decode up to frames samples into block as output samples, reading blocks from the
+// card as needed. poll_fn (if not NULL) is called while the card transfers data.
+// Returns the count of samples decoded, 0 at end of data, -1 on error or abort
+s16 adpcm_read(s16 *block,u16 frames,int (*poll_fn)());
+
+// CPU cycles per stereo sample taken by the decoder, working in ram. Stops output
+u32 bench_adpcm(adpcm_ram *ram);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  CONVERT.C:  Sample format converters
+**
+**  Formats other than stereo 16-bit are read with read() and converted in place to
+**  stereo 16-bit samples, ahead of the DAC conversion of commit_buffer(). Mono and
+**  8-bit files also need fewer card sectors per second
+*/
+
+#include <stdio.h>
+#include "convert.h"
+#include "ffs.h"
+#include "types.h"
+
+// 16-bit sample of each input sample type, little endian
+#define u8s(p)		((s16)(((p)[0] - 128) << 8))
+#define s16s(p)		((s16)((p)[0] | ((p)[1] << 8)))
+#define s24s(p)		((s16)((p)[1] | ((p)[2] << 8)))
+#define s32s(p)		((s16)((p)[2] | ((p)[3] << 8)))
+#define f32s(p)		f32_s16((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((u32)(p)[3] << 24))
+
+// 16-bit sample of an IEEE float in -1.0 .. 1.0, clipped, without floating point code
+static s16 f32_s16(u32 f)
+{
+	u32 e = (f >> 23) & 255;
+	s32 x;
+
+	// below 1 LSB
+	if(e < 127 - 15)
+		return 0;
+
+	// full scale
+	if(e >= 127)
+		return (f & 0x80000000) ? -32768 : 32767;
+
+	// mantissa (with its implicit 1) scaled by 2^(e - 127 - 23) * 32768
+	x = (s32)(((f & 0x7FFFFF) | 0x800000) >> (135 - e));
+
+	return (f & 0x80000000) ? -x : x;
+}
+
+// A converter is a loop specialised for one input format, producing a stereo 16-bit
+// word per input sample
+#define CONVERTER(name,bytes,left,right)						\
+static void name(const u8 *in,u32 *out,u16 frames)				\
+{																\
+	for(;frames;frames--,in+=(bytes))							\
+		*out++ = (u16)(left) | ((u32)(u16)(right) << 16);		\
+}
+
+CONVERTER(u8_mono,		1,	u8s(in),	u8s(in))
+CONVERTER(u8_stereo,	2,	u8s(in),	u8s(in + 1))
+CONVERTER(s16_mono,		2,	s16s(in),	s16s(in))
+CONVERTER(s24_mono,		3,	s24s(in),	s24s(in))
+CONVERTER(s24_stereo,	6,	s24s(in),	s24s(in + 3))
+CONVERTER(s32_mono,		4,	s32s(in),	s32s(in))
+CONVERTER(s32_stereo,	8,	s32s(in),	s32s(in + 4))
+CONVERTER(f32_mono,		4,	f32s(in),	f32s(in))
+CONVERTER(f32_stereo,	8,	f32s(in),	f32s(in + 4))
+
+// Supported formats, by channels (1..2) and bytes per sample (1..4)
+static const sample_format pcm_formats[2][4] =
+{
+	{ { 1, u8_mono },	{ 2, s16_mono },	{ 3, s24_mono },	{ 4, s32_mono } },
+	{ { 2, u8_stereo },	{ 4, NULL },		{ 6, s24_stereo },	{ 8, s32_stereo } },
+};
+
+static const sample_format float_formats[2] =
+{
+	{ 4, f32_mono }, { 8, f32_stereo },
+};
+
+// find the format of WAV data
+const sample_format *find_format(u16 tag,u16 channels,u16 bits)
+{
+	if(channels < 1 || channels > 2)
+		return NULL;
+
+	if(tag == WAVE_FORMAT_PCM && (bits == 8 || bits == 16 || bits == 24 || bits == 32))
+		return &pcm_formats[channels - 1][(bits >> 3) - 1];
+
+	if(tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32)
+		return &float_formats[channels - 1];
+
+	return NULL;
+}
+
+// read and convert up to frames samples. The input is read into the end of the block
+// and converted forward, so output never overtakes unread input. Formats larger than
+// the output take several passes, each filling the room left after the output, and
+// a last sample that no longer fits goes through a small buffer
+s16 read_frames(u8 handle,s16 *block,u16 frames,const sample_format *fmt)
+{
+	u8 *end=(u8 *)block + ((u32)frames << 2),*in;
+	u8 last[8];
+	u16 done=0,n,bytes;
+	s16 actual;
+
+	while(done < frames)
+	{
+		n = ((u16)(end - (u8 *)block) - (done << 2)) / fmt->frame_bytes;
+		if(n > frames - done)
+			n = frames - done;
+
+		if(n)
+		{
+			bytes = n * fmt->frame_bytes;
+			in = end - bytes;
+		}
+		else
+		{
+			bytes = fmt->frame_bytes;
+			in = last;
+		}
+
+		actual = read(handle, in, bytes);
+		if(actual < 0)
+			return -1;
+
+		// a partial sample at the end of the file is dropped
+		n = (u16)actual / fmt->frame_bytes;
+
+		if(fmt->convert)
+			fmt->convert(in, (u32 *)block + done, n);
+
+		done += n;
+
+		if((u16)actual < bytes)
+			break;
+	}
+
+	return done;
+}
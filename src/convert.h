@@ -0,0 +1,36 @@
+#ifndef _CONVERT_H
+#define _CONVERT_H
+
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  Sample format converters
+*/
+
+#include "types.h"
+
+// WAV format tags
+#define WAVE_FORMAT_PCM			0x0001
+#define WAVE_FORMAT_IEEE_FLOAT	0x0003
+#define WAVE_FORMAT_IMA_ADPCM	0x0011	// see adpcm.h
+#define WAVE_FORMAT_EXTENSIBLE	0xFFFE	// actual tag in the 1st 2 bytes of the subformat GUID
+
+// A sample format, and its converter to the output samples (stereo 16-bit, left in the
+// low half of each word). Output samples have no converter
+typedef struct
+{
+	u8 frame_bytes;		// bytes per sample of all channels
+	void (*convert)(const u8 *in,u32 *out,u16 frames);
+} sample_format;
+
+// find the format of WAV data, NULL if not supported
+const sample_format *find_format(u16 tag,u16 channels,u16 bits);
+
+// read up to frames samples of format fmt into block as output samples, converted in
+// place. block must hold frames output samples.
+// Returns the count of samples read, 0 at end of file, -1 on error
+s16 read_frames(u8 handle,s16 *block,u16 frames,const sample_format *fmt);
+
+#endif
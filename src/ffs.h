@@ -7,7 +7,7 @@
 
 /*
 
-Description:	FAT16 file system POSIX interface
+Description:	FAT16/FAT32 (and read only exFAT) file system POSIX interface
 
 */
 
@@ -49,6 +49,30 @@ bool hd_mbr(void);			// hd_mbr() : read disk Master Boot Record, check it and an
 
 bool hd_bpb(void);	// Analyze partition Boot Param Block to find out addresses of FAT and rootdir
 
+void fs_cache_stats(u32 *hits,u32 *misses);	// Return sector cache hit and miss counts
+
+// File system operations, as counted by fs_get_stats()
+#define FS_OP_MOUNT			0	// hd_mbr(), hd_bpb()
+#define FS_OP_SCAN			1	// catalog_build(), scan_dirs(), scan_tracks()
+#define FS_OP_OPEN			2	// open(), open_track()
+#define FS_OP_LSEEK			3	// lseek()
+#define FS_OP_READ			4	// read()
+#define FS_OP_READ_SECTORS	5	// read_sectors()
+#define FS_OP_SAVE			6	// catalog_save()
+#define FS_OPS				7
+
+typedef struct
+{
+	u32 calls;		// count of calls
+	u32 sectors;	// sectors read from the card, including FAT and directory sectors
+} fs_op_stats;
+
+void fs_get_stats(u8 op,fs_op_stats *stats);	// Return the counters of an operation
+
+void fs_clear_stats(void);
+
+void fs_dump_stats(void);	// Print operation counters on the serial port
+
 s8  close(u8 handle);
 									/* Close file handle
 										Parameter
@@ -167,8 +191,16 @@ s16  read(u8 handle, u8 *buffer, u16 count);
 												returns -1 and sets errno to EBADF.
 									*/
 
-s16 read_sectors(u8 handle,u8 *buffer,u16 sectors);
-  
+s16 read_sectors(u8 handle,u8 *buffer,u16 sectors,int (*poll_fn)());
+									/* Reads whole sectors directly into buffer, overlapping
+										the card transfer with calls to poll_fn (may be NULL).
+
+										Returns
+											the number of sectors read. A return value of -1
+											indicates an error, or that poll_fn returned
+											non-zero and the read was abandoned.
+									*/
+
 
 long  lseek(u8 handle, s32 offset, u8 origin);
 									/* Move a file pointer to the specified location.
@@ -212,10 +244,38 @@ typedef struct
 } dirent __attribute__((packed));
 
 
+// Max count of open files
+#ifndef MAX_FILES
+#define MAX_FILES	4
+#endif
+
+// Sector buffers handed to open files, so partial sector reads of a file are not
+// evicted by other files. Files opened when all are taken share the sector cache
+#ifndef FILE_BUFFERS
+#define FILE_BUFFERS	2
+#endif
+
+// Max count of physically contiguous runs mapped per open file. Sectors beyond the
+// last mapped run are found by following the FAT
+#ifndef FILE_MAX_EXTENTS
+#define FILE_MAX_EXTENTS 16
+#endif
+
+// Physically contiguous run of file sectors
+typedef struct
+{
+	u32 lba;		// 1st sector of run
+	u32 end;		// file sector offset just past the run
+} extent;
+
 typedef struct
 {
-	u16	clust;		// 1st cluster of file (as found in dirent)
-	u32 sector_rl;	// contigous sectors found (minimises rescanning of FAT)
+	u32	clust;		// 1st cluster of file (as found in dirent)
+	extent map[FILE_MAX_EXTENTS];	// runs of the file, in file order
+	u8	extents;	// count of runs in map
+	u8	complete;	// map covers the whole cluster chain
+	u8	ext;		// run holding curlba (extents if past the map)
+	u32 sector_rl;	// contiguous sectors following curlba (minimises rescanning of FAT)
 	u32 curlba;		// LBA of current sector being read / written to
 	u32	pos;		// Current file pointer (u8 offset from start of file)
 	u32	size;		// Current file size (u8 count of file)
@@ -224,11 +284,54 @@ typedef struct
 	
 	u32 dirlba;		// LBA of dir sector
 	dirent *dirptr;	// ptr of file in secbuf when dirlba is in secbuf
+
+	u8	*buf;		// sector buffer of the file, NULL if it uses the sector cache
+	u32	buflba;		// LBA held by buf, -1 if none
 } file_handle;
 
+// Track catalog limits
+#ifndef CATALOG_MAX_DIRS
+#define CATALOG_MAX_DIRS	64
+#endif
+
+#ifndef CATALOG_MAX_TRACKS
+#define CATALOG_MAX_TRACKS	256
+#endif
+
+// Catalog entry of a directory or track
+typedef struct
+{
+	u32	size;		// file size
+	u32	clust;		// 1st cluster
+	char name[11];	// 8+3 name, as found in dirent
+	u8	flags;		// CATALOG_CONTIG
+} catalog_entry;
+
+// Catalog entry flags
+#define CATALOG_CONTIG	0x01	// clusters are contiguous and not recorded in the FAT (exFAT NoFatChain)
+
+// scan the card's directories and tracks into the catalog, return track count
+s16 catalog_build(void);
+
+// start scanning the card into the catalog in slices, so playback can start meanwhile
+void catalog_start(void);
+
+// scan the next slice, return TRUE once the catalog is complete. Directories not scanned
+// yet are finished on demand by scan_dirs(), scan_tracks() and open_track()
+bool catalog_step(void);
+
+// load the catalog saved on the card, FALSE if missing or the card has changed
+bool catalog_load(void);
+
+// save the catalog to the card
+bool catalog_save(void);
+
 // scan to a particular directory, or return total count
 s16 scan_dirs(int index,char *dirname);	
 
 s16 scan_tracks(int dirno,int fileno,char *filename,char *dirname);
 
+// open a catalog track for reading
+s8 open_track(int dirno,int fileno);
+
 #endif
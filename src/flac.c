@@ -0,0 +1,863 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  FLAC.C:  FLAC decoder
+**
+**  Lossless tracks at about half the card bandwidth of WAV. Frames are decoded a
+**  channel at a time : the 1st channel of a frame is kept whole, the 2nd is decoded
+**  in short chunks and combined with it into output samples in the same buffer, so a
+**  frame needs one word per sample. The file is read a sector at a time with
+**  read_sectors(), and its bits taken MSB first from a 32-bit word.
+**  Frame CRC-16s and the MD5 signature are not checked
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "flac.h"
+#include "ffs.h"
+#include "timing.h"
+#include "types.h"
+
+#ifdef FLAC_DECODER
+
+// samples of a channel decoded between calls to flush(), and predictor history
+#define CHUNK		FLAC_CHUNK
+#define MAX_ORDER	FLAC_MAX_ORDER
+
+// channel assignments of a frame, other than independent channels
+#define LEFT_SIDE	8
+#define SIDE_RIGHT	9
+#define MID_SIDE	10
+
+// input
+static u8 *sector;					// file data, in the RAM lent to the decoder
+static const u8 *in_ptr,*in_end;	// next byte of sector, end of its file data
+static u32 bitbuf;					// unread bits, MSB first, followed by 0s
+static s32 bitcount;				// count of unread bits
+static s32 pad;						// 0 bits added past the end of the file
+static s8 in_error;					// the file ended (1) or could not be read (-1)
+static bool looping;				// sector is read over and over, by the benchmark
+
+static u8 handle;
+static u32 file_size;
+static int (*poll_read)();
+
+// stream
+static u8 channels,bps;
+static u8 up,down;					// shifts of samples to 16 bits
+
+// frame
+static u16 blocksize;
+static u8 assignment;
+static u32 *frame;						// samples of the 1st channel, then output samples
+static u16 pos,avail;					// next output sample, output samples in frame
+
+// subframe
+static s32 *window;						// history of the predictor, then the chunk
+static s32 coef[MAX_ORDER];				// LPC coefficients
+
+// leading 0s of a nibble
+static const u8 zeros[16] = { 4, 3, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// bits of the sample size codes of a frame header, 0 if from STREAMINFO or reserved
+static const u8 sample_bits[8] = { 0, 8, 12, 0, 16, 20, 24, 0 };
+
+//
+// bit reader
+//
+
+// load the next sector of the file. FALSE at the end or on error
+static bool load(void)
+{
+	u32 at;
+	s16 n;
+
+	if(in_error)
+		return FALSE;
+
+	if(looping)
+	{
+		in_ptr = sector;
+		return TRUE;
+	}
+
+	at = lseek(handle, 0, SEEK_CUR);
+	n = read_sectors(handle, sector, 1, poll_read);
+
+	if(n <= 0)
+	{
+		in_error = n < 0 ? -1 : 1;
+		return FALSE;
+	}
+
+	in_ptr = sector;
+	in_end = sector + (file_size - at < 512 ? file_size - at : 512);
+
+	return TRUE;
+}
+
+// top up the bit buffer to more than 24 bits, with 0s past the end of the file
+static void refill(void)
+{
+	while(bitcount <= 24)
+	{
+		if(in_ptr < in_end || load())
+			bitbuf |= (u32)*in_ptr++ << (24 - bitcount);
+		else
+			pad += 8;
+
+		bitcount += 8;
+	}
+}
+
+// next n bits, n up to 24
+static inline u32 bits(u32 n)
+{
+	u32 v;
+
+	if(bitcount < (s32)n)
+		refill();
+
+	v = n ? bitbuf >> (32 - n) : 0;
+
+	bitbuf <<= n;
+	bitcount -= n;
+
+	return v;
+}
+
+// next n bits, n up to 32
+static u32 long_bits(u32 n)
+{
+	if(n <= 24)
+		return bits(n);
+
+	n -= 16;
+
+	return (bits(n) << 16) | bits(16);
+}
+
+// next n bits as a signed number, n from 1 to 32
+static s32 sbits(u32 n)
+{
+	return (s32)(long_bits(n) << (32 - n)) >> (32 - n);
+}
+
+// count of 0 bits up to the next 1 bit, which is dropped
+static inline u32 unary(void)
+{
+	u32 q = 0,z;
+
+	while(!bitbuf)
+	{
+		q += bitcount;
+		bitcount = 0;
+
+		refill();
+
+		if(!bitbuf && in_error)
+			return q;
+	}
+
+	while(!(bitbuf >> 28))
+	{
+		bitbuf <<= 4;
+		bitcount -= 4;
+		q += 4;
+	}
+
+	z = zeros[bitbuf >> 28] + 1;
+
+	bitbuf <<= z;
+	bitcount -= z;
+
+	return q + z - 1;
+}
+
+// skip n bytes, from a byte boundary
+static void skip(u32 n)
+{
+	u32 at;
+
+	// bytes in the bit buffer
+	for( ; n && bitcount >= 8 ; n--)
+		bits(8);
+
+	// bytes of the sector
+	if(n <= (u32)(in_end - in_ptr))
+	{
+		in_ptr += n;
+		return;
+	}
+
+	n -= in_end - in_ptr;
+	in_ptr = in_end;
+
+	// seek to the sector holding the rest
+	at = lseek(handle, 0, SEEK_CUR) + n;
+
+	if(at >= file_size)
+	{
+		in_error = 1;
+		return;
+	}
+
+	lseek(handle, at & ~511, SEEK_SET);
+
+	if((at & 511) && load())
+		in_ptr += at & 511;
+}
+
+//
+// subframes
+//
+
+// Rice coded residuals with parameter k
+static void rice(s32 *x,u16 n,u8 k)
+{
+	u32 v;
+
+	if(k > 24)
+	{
+		for( ; n ; n--)
+		{
+			v = (unary() << k) | long_bits(k);
+			*x++ = (s32)(v >> 1) ^ -(s32)(v & 1);
+		}
+		return;
+	}
+
+	for( ; n ; n--)
+	{
+		v = (unary() << k) | bits(k);
+		*x++ = (s32)(v >> 1) ^ -(s32)(v & 1);
+	}
+}
+
+// add the fixed polynomial prediction of each of n samples from the ones before it
+static void fixed(s32 *x,u16 n,u8 order)
+{
+	switch(order)
+	{
+		case 1:
+			for( ; n ; n--,x++)
+				x[0] += x[-1];
+			break;
+
+		case 2:
+			for( ; n ; n--,x++)
+				x[0] += (x[-1] << 1) - x[-2];
+			break;
+
+		case 3:
+			for( ; n ; n--,x++)
+				x[0] += 3 * (x[-1] - x[-2]) + x[-3];
+			break;
+
+		case 4:
+			for( ; n ; n--,x++)
+				x[0] += ((x[-1] + x[-3]) << 2) - 6 * x[-2] - x[-4];
+			break;
+	}
+}
+
+// add the LPC prediction of each of n samples from the ones before it. wide if the
+// sums may not fit 32 bits
+static void lpc(s32 *x,u16 n,u8 order,u8 shift,bool wide)
+{
+	s32 sum;
+	long long wsum;
+	u8 j;
+
+	if(wide)
+	{
+		for( ; n ; n--,x++)
+		{
+			for(wsum = 0, j = 0 ; j < order ; j++)
+				wsum += (long long)coef[j] * x[-1 - j];
+
+			x[0] += (s32)(wsum >> shift);
+		}
+		return;
+	}
+
+	for( ; n ; n--,x++)
+	{
+		for(sum = 0, j = 0 ; j < order ; j++)
+			sum += coef[j] * x[-1 - j];
+
+		x[0] += sum >> shift;
+	}
+}
+
+// output sample, from left and right samples of the stream
+#define OUTPUT(l,r)	((u16)(((l) << up) >> down) | ((u32)(u16)(((r) << up) >> down) << 16))
+
+// pass on n samples of channel ch, from sample at of the frame
+static void flush(u8 ch,u16 at,const s32 *x,u16 n,u8 wasted)
+{
+	u32 *out = frame + at;
+	s32 a,b,m;
+
+	if(channels == 1)
+	{
+		for( ; n ; n--,x++)
+		{
+			a = *x << wasted;
+			*out++ = OUTPUT(a, a);
+		}
+		return;
+	}
+
+	// keep the 1st channel
+	if(ch == 0)
+	{
+		for( ; n ; n--)
+			*out++ = *x++ << wasted;
+		return;
+	}
+
+	// combine the 2nd with it
+	switch(assignment)
+	{
+		case LEFT_SIDE:
+			for( ; n ; n--,x++,out++)
+			{
+				a = *out;
+				b = *x << wasted;
+				*out = OUTPUT(a, a - b);
+			}
+			break;
+
+		case SIDE_RIGHT:
+			for( ; n ; n--,x++,out++)
+			{
+				a = *out;
+				b = *x << wasted;
+				*out = OUTPUT(a + b, b);
+			}
+			break;
+
+		case MID_SIDE:
+			for( ; n ; n--,x++,out++)
+			{
+				b = *x << wasted;
+				m = (*out << 1) | (b & 1);
+				*out = OUTPUT((m + b) >> 1, (m - b) >> 1);
+			}
+			break;
+
+		default:
+			for( ; n ; n--,x++,out++)
+			{
+				a = *out;
+				b = *x << wasted;
+				*out = OUTPUT(a, b);
+			}
+			break;
+	}
+}
+
+// decode the subframe of channel ch, of samples of sbps bits. FALSE if it is not valid
+static bool subframe(u8 ch,u8 sbps)
+{
+	s32 *x = window + MAX_ORDER;
+	u32 type,i;
+	u16 done,filled,run,count,psize,part,parts;
+	u8 wasted = 0,order = 0,precision,shift = 0,k,pbits;
+	bool is_lpc = FALSE,wide = FALSE,escaped;
+	s32 value;
+
+	if(bits(1))
+		return FALSE;
+
+	type = bits(6);
+
+	// wasted bits : the samples are shifted left by as many bits
+	if(bits(1))
+	{
+		wasted = unary() + 1;
+
+		if(wasted >= sbps)
+			return FALSE;
+
+		sbps -= wasted;
+	}
+
+	// constant and verbatim subframes
+	if(type < 2)
+	{
+		value = type ? 0 : sbits(sbps);
+
+		for(done = 0 ; done < blocksize ; done += run)
+		{
+			run = blocksize - done < CHUNK ? blocksize - done : CHUNK;
+
+			for(i = 0 ; i < run ; i++)
+				x[i] = type ? sbits(sbps) : value;
+
+			flush(ch, done, x, run, wasted);
+		}
+
+		return TRUE;
+	}
+
+	// fixed polynomial of order 0 to 4
+	if(type >= 8 && type <= 12)
+		order = type - 8;
+	// LPC of order 1 to 32
+	else if(type >= 32)
+	{
+		order = (type & 31) + 1;
+		is_lpc = TRUE;
+	}
+	else
+		return FALSE;
+
+	if(order > blocksize)
+		return FALSE;
+
+	// warm up samples
+	for(i = 0 ; i < order ; i++)
+		x[i] = sbits(sbps);
+
+	if(is_lpc)
+	{
+		precision = bits(4) + 1;
+		if(precision == 16)
+			return FALSE;
+
+		value = sbits(5);
+		if(value < 0)
+			return FALSE;
+		shift = value;
+
+		for(i = 0 ; i < order ; i++)
+			coef[i] = sbits(precision);
+
+		// sums fit 32 bits if sbps + precision + log2(order) does
+		for(i = order, value = 0 ; i > 1 ; i >>= 1)
+			value++;
+
+		wide = sbps + precision + value > 32;
+	}
+
+	// residual : coding method, partition order
+	i = bits(2);
+	if(i > 1)
+		return FALSE;
+
+	pbits = i ? 5 : 4;
+
+	i = bits(4);
+	parts = 1 << i;
+	psize = blocksize >> i;
+
+	if(psize << i != blocksize || psize < order)
+		return FALSE;
+
+	done = 0;
+	filled = order;
+
+	for(part = 0 ; part < parts ; part++)
+	{
+		k = bits(pbits);
+
+		// escaped partition : k bit verbatim residuals
+		escaped = k == (1 << pbits) - 1;
+		if(escaped)
+			k = bits(5);
+
+		for(count = part ? psize : psize - order ; count ; count -= run)
+		{
+			run = CHUNK - filled < count ? CHUNK - filled : count;
+
+			if(!escaped)
+				rice(x + filled, run, k);
+			else
+				for(i = 0 ; i < run ; i++)
+					x[filled + i] = k ? sbits(k) : 0;
+
+			if(is_lpc)
+				lpc(x + filled, run, order, shift, wide);
+			else
+				fixed(x + filled, run, order);
+
+			filled += run;
+
+			// pass on a full chunk, keeping the history for the next one
+			if(filled == CHUNK)
+			{
+				flush(ch, done, x, CHUNK, wasted);
+				memcpy(x - order, x + CHUNK - order, order << 2);
+
+				done += CHUNK;
+				filled = 0;
+			}
+		}
+	}
+
+	if(filled)
+		flush(ch, done, x, filled, wasted);
+
+	return TRUE;
+}
+
+//
+// frames
+//
+
+// CRC-8 of a frame header (polynomial x^8 + x^2 + x + 1)
+static u8 crc8(const u8 *p,u8 n)
+{
+	u8 crc = 0,i;
+
+	while(n--)
+	{
+		crc ^= *p++;
+
+		for(i = 0 ; i < 8 ; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+}
+
+// find and read the next frame header. FALSE if none or not supported
+static bool frame_header(void)
+{
+	u8 h[16],n,code,m;
+	u32 size;
+
+	// frames start on a byte boundary, with sync code 0xFFF8 (0xFFF9 if the block
+	// size varies)
+	bits(bitcount & 7);
+
+	h[1] = bits(8);
+
+	do
+	{
+		if(in_error && bitcount <= pad)
+			return FALSE;
+
+		h[0] = h[1];
+		h[1] = bits(8);
+	}
+	while(h[0] != 0xFF || (h[1] & 0xFE) != 0xF8);
+
+	h[2] = bits(8);
+	h[3] = bits(8);
+
+	// frame or sample number, UTF-8 coded in up to 7 bytes
+	code = h[4] = bits(8);
+	n = 5;
+
+	if(code & 0x80)
+	{
+		if((code & 0xC0) == 0x80 || code == 0xFF)
+			return FALSE;
+
+		for(m = code << 1 ; m & 0x80 ; m <<= 1)
+			h[n++] = bits(8);
+	}
+
+	// block size
+	code = h[2] >> 4;
+
+	if(code == 0)
+		return FALSE;
+	else if(code == 1)
+		size = 192;
+	else if(code <= 5)
+		size = 576 << (code - 2);
+	else if(code == 6)
+	{
+		h[n] = bits(8);
+		size = h[n++] + 1;
+	}
+	else if(code == 7)
+	{
+		h[n] = bits(8);
+		h[n + 1] = bits(8);
+		size = ((h[n] << 8) | h[n + 1]) + 1;
+		n += 2;
+	}
+	else
+		size = 256 << (code - 8);
+
+	// sample rate, if not a coded one
+	code = h[2] & 15;
+
+	if(code == 15)
+		return FALSE;
+	else if(code == 12)
+		h[n++] = bits(8);
+	else if(code > 12)
+	{
+		h[n++] = bits(8);
+		h[n++] = bits(8);
+	}
+
+	h[n] = bits(8);
+
+	if(crc8(h, n) != h[n])
+		return FALSE;
+
+	// channels and sample size as in STREAMINFO
+	assignment = h[3] >> 4;
+
+	if(assignment < 8 ? assignment + 1 != channels : assignment > MID_SIDE || channels != 2)
+		return FALSE;
+
+	code = (h[3] >> 1) & 7;
+
+	if((code && sample_bits[code] != bps) || (h[3] & 1))
+		return FALSE;
+
+	if(size > FLAC_MAX_BLOCKSIZE)
+		return FALSE;
+
+	blocksize = size;
+
+	return TRUE;
+}
+
+// decode the subframes of a frame. FALSE if not valid
+static bool frame_body(void)
+{
+	u8 ch,side;
+
+	// the side channel has an extra bit
+	side = assignment == SIDE_RIGHT ? 0 : assignment == LEFT_SIDE || assignment == MID_SIDE ? 1 : 0xFF;
+
+	for(ch = 0 ; ch < channels ; ch++)
+		if(!subframe(ch, bps + (ch == side)))
+			return FALSE;
+
+	// padding to a byte boundary, CRC-16
+	bits(bitcount & 7);
+	bits(16);
+
+	// all of it was in the file
+	return bitcount >= pad;
+}
+
+// decode the next frame. FALSE at end of file, -1 on error
+static s8 next_frame(void)
+{
+	for(;;)
+	{
+		if(frame_header() && frame_body())
+		{
+			pos = 0;
+			avail = blocksize;
+			return TRUE;
+		}
+
+		if(in_error < 0)
+			return -1;
+
+		if(in_error && bitcount <= pad)
+			return FALSE;
+	}
+}
+
+// start decoding the FLAC file of handle
+u32 flac_start(flac_ram *ram,u8 fd,u32 *sample_rate)
+{
+	u32 last,type,len,total = 0;
+
+	sector = ram->sector;
+	frame = ram->frame;
+	window = ram->window;
+
+	handle = fd;
+	file_size = lseek(fd, 1, SEEK_END);
+
+	if(lseek(fd, 0, SEEK_SET) < 0)
+		return 0;
+
+	in_ptr = in_end = sector;
+	bitbuf = 0;
+	bitcount = pad = 0;
+	in_error = 0;
+	looping = FALSE;
+	poll_read = NULL;
+
+	pos = avail = 0;
+	channels = 0;
+
+	if(bits(16) != 0x664C || bits(16) != 0x6143)		// "fLaC"
+		return 0;
+
+	// metadata blocks : last flag, type, length
+	do
+	{
+		last = bits(1);
+		type = bits(7);
+		len = bits(24);
+
+		// STREAMINFO
+		if(type == 0 && len >= 18)
+		{
+			bits(16);						// min block size
+			if(bits(16) > FLAC_MAX_BLOCKSIZE)
+				return 0;
+
+			bits(24);						// min, max frame size
+			bits(24);
+
+			*sample_rate = bits(20);
+			channels = bits(3) + 1;
+			bps = bits(5) + 1;
+
+			// sample count, if it fits 32 bits
+			total = bits(4);
+			total = long_bits(32) | (total ? 0xFFFFFFFF : 0);
+
+			len -= 18;
+		}
+
+		skip(len);
+	}
+	while(!last && !in_error);
+
+	if(in_error || channels < 1 || channels > 2 || bps < 8 || bps > 24)
+		return 0;
+
+	up = bps < 16 ? 16 - bps : 0;
+	down = bps > 16 ? bps - 16 : 0;
+
+	return total ? total : 0xFFFFFFFF;
+}
+
+// decode up to frames samples into block
+s16 flac_read(s16 *block,u16 frames,int (*poll_fn)())
+{
+	u32 *w = (u32 *)block;
+	u16 done = 0,n;
+	s8 rc;
+
+	poll_read = poll_fn;
+
+	while(done < frames)
+	{
+		if(pos == avail)
+		{
+			rc = next_frame();
+
+			if(rc < 0)
+				return -1;
+
+			if(!rc)
+				break;
+		}
+
+		n = avail - pos;
+		if(n > frames - done)
+			n = frames - done;
+
+		memcpy(w + done, frame + pos, n << 2);
+
+		pos += n;
+		done += n;
+	}
+
+	return done;
+}
+
+//
+// benchmark
+//
+
+// LPC coefficients of the benchmark frame, shifted by 10. Their gain is below 1, so the
+// samples stay bounded whatever the residuals
+static const s16 bench_coef[8] = { 300, -80, 50, -30, 20, -15, 10, -5 };
+
+// write the n low bits of v to the sector from bit at. Returns the bit after them
+static u32 bench_bits(u32 at,u32 v,u8 n)
+{
+	while(n--)
+	{
+		if((v >> n) & 1)
+			sector[at >> 3] |= 0x80 >> (at & 7);
+		else
+			sector[at >> 3] &= ~(0x80 >> (at & 7));
+
+		at++;
+	}
+
+	return at;
+}
+
+// decode the subframes of the benchmark frame, each from its half of the sector
+static void bench_frame(void)
+{
+	u8 ch;
+
+	for(ch = 0 ; ch < 2 ; ch++)
+	{
+		in_ptr = sector + (ch << 8);
+		bitbuf = 0;
+		bitcount = 0;
+
+		subframe(ch, bps + ch);
+	}
+}
+
+// CPU cycles per frame of the decoder : FLAC_MAX_BLOCKSIZE mid-side stereo samples of
+// 16 bits, LPC of order 8, Rice residuals with 9 low bits. Residuals are taken from
+// arbitrary data, read over and over from the sector. Stops output and ends any decoding
+u32 bench_flac(flac_ram *ram)
+{
+	u32 at,seed = 1;
+	u16 i;
+	u8 ch;
+
+	sector = ram->sector;
+	frame = ram->frame;
+	window = ram->window;
+
+	for(i = 0 ; i < 512 ; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		sector[i] = seed >> 24;
+	}
+
+	// each half starts with a subframe header : LPC of order 8 without wasted bits,
+	// warm up samples, precision 12, shift 10, coefficients, then one Rice partition
+	for(ch = 0 ; ch < 2 ; ch++)
+	{
+		at = bench_bits(ch << 11, (32 + 7) << 1, 8);
+
+		for(i = 0 ; i < 8 ; i++)
+			at = bench_bits(at, 0, 16 + ch);
+
+		at = bench_bits(at, 12 - 1, 4);
+		at = bench_bits(at, 10, 5);
+
+		for(i = 0 ; i < 8 ; i++)
+			at = bench_bits(at, (u16)bench_coef[i], 12);
+
+		bench_bits(at, 9, 2 + 4 + 4);
+	}
+
+	channels = 2;
+	bps = 16;
+	up = down = 0;
+	blocksize = FLAC_MAX_BLOCKSIZE;
+	assignment = MID_SIDE;
+
+	in_end = sector + 512;
+	in_error = 0;
+	pad = 0;
+	looping = TRUE;
+	poll_read = NULL;
+	pos = avail = 0;
+
+	return time_cycles(bench_frame);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _FLAC_H
+#define _FLAC_H
+
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  FLAC decoder
+*/
+
+#include "types.h"
+
+// define this to list .FLA files as tracks and play them. The decoder works in about
+// 5.5KB of RAM with the default block size, shared with the ADPCM decoder
+#define FLAC_DECODER
+
+// largest block size (samples per channel in a frame) played. Encode with flac -b 1152
+// or less, files with larger blocks are not played
+#ifndef FLAC_MAX_BLOCKSIZE
+#define FLAC_MAX_BLOCKSIZE	1152
+#endif
+
+// samples of a channel decoded at a time, and the highest predictor order
+#define FLAC_CHUNK		64
+#define FLAC_MAX_ORDER	32
+
+// 1st long of a FLAC file
+#define FLAC_MARKER		0x43614C66	// "fLaC"
+
+// RAM the decoder works in, lent by the player for the track
+typedef struct
+{
+	u32 frame[FLAC_MAX_BLOCKSIZE];				// samples of the 1st channel, then output samples
+	s32 window[FLAC_MAX_ORDER + FLAC_CHUNK];	// history of the predictor, then the chunk
+	u8 sector[512];								// file data being decoded
+} flac_ram;
+
+// start decoding the FLAC file of handle, from its start, in ram. Returns the count of
+// samples in it (0xFFFFFFFF if unknown) and its sample rate, 0 if the stream is not
+// supported
+u32 flac_start(flac_ram *ram,u8 handle,u32 *sample_rate);
+
+// decode up to frames samples into block as output samples, reading the file as
+// needed. poll_fn (if not NULL) is called while the card transfers data.
+// Returns the count of samples decoded, 0 at end of file, -1 on error or abort
+s16 flac_read(s16 *block,u16 frames,int (*poll_fn)());
+
+// CPU cycles per frame of FLAC_MAX_BLOCKSIZE stereo samples taken by the decoder,
+// working in ram. Stops output and ends any decoding
+u32 bench_flac(flac_ram *ram);
+
+#endif
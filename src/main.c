@@ -17,6 +17,10 @@
 #include "serial.h"
 #include "headend.h"
 #include "control.h"
+#include "mmc.h"
+#include "convert.h"
+#include "adpcm.h"
+#include "flac.h"
 
 char file[16];  		// active file
 char dir[16];			// active directory
@@ -28,6 +32,18 @@ static bool shuffle;	  	// track shuffle active
 static u32 timemark;	  	// track timer (ticks)
 int secs;				  	// converted to seconds
 static int last_secs;	  	// elapsed second detector
+static bool indexing;		// catalog being scanned in the background
+static bool indexed;		// catalog scanned, to be saved once no track plays
+
+// RAM of the decoders. Only one track plays at a time, so they share it. play_wav()
+// lends it to the decoder of the track, the benchmarks use it while stopped
+static union
+{
+	adpcm_ram adpcm;
+#ifdef FLAC_DECODER
+	flac_ram flac;
+#endif
+} decoder_ram;
 
 // playback control 
 
@@ -206,6 +222,17 @@ int poll(void)
 	}
 	else
 		secs=0;
+
+#ifndef SIMULATION
+	// scan the rest of the card a slice at a time, between card transfers. Saving
+	// the catalog writes the card for longer than the output ring lasts, so that is
+	// left to save_catalog() between tracks
+	if(indexing && mmc_ReadIdle() && catalog_step())
+	{
+		indexing=FALSE;
+		indexed=TRUE;
+	}
+#endif
    
    // scan head end for commands
    if(poll_headend())
@@ -235,6 +262,59 @@ int poll(void)
 				toggle_repeat(); return 0;
 			case '?':
 				toggle_shuffle(); return 0;
+#ifndef SIMULATION
+			case 'l':
+				mmc_DumpStats(); fs_dump_stats(); dump_audio_stats(); return 0;
+#ifdef INTERNAL_DAC
+			case 'b':
+				// time the DAC output stage, only while stopped
+				if(!playing)
+				{
+					puts(itoa(bench_output_stage(),16));
+					puts(" cycles per sample\n\r");
+				}
+				return 0;
+#endif
+			case 'a':
+				// time the ADPCM decoder, only while stopped
+				if(!playing)
+				{
+					puts(itoa(bench_adpcm(&decoder_ram.adpcm),16));
+					puts(" cycles per sample\n\r");
+				}
+				return 0;
+#ifdef FLAC_DECODER
+			case 'f':
+				// time the FLAC decoder on a frame, only while stopped
+				if(!playing)
+				{
+					u32 cycles=bench_flac(&decoder_ram.flac);
+
+					puts(itoa(cycles,16));
+					puts(" cycles per frame, ");
+					puts(itoa(cycles/FLAC_MAX_BLOCKSIZE,16));
+					puts(" per sample\n\r");
+				}
+				return 0;
+#endif
+			case 'k':
+				// time the SPI receive of a sector, byte loop then word kernel, only while stopped
+				// as it lands in the decoder RAM
+				if(!playing)
+				{
+					puts(itoa(mmc_BenchRead(FALSE,(u32 *)decoder_ram.adpcm.block),16));
+					puts(" / ");
+					puts(itoa(mmc_BenchRead(TRUE,(u32 *)decoder_ram.adpcm.block),16));
+					puts(" cycles per sector\n\r");
+				}
+				return 0;
+			case 'c':
+				// rescan the card, saving the catalog once done
+				catalog_start();
+				indexing=TRUE;
+				indexed=FALSE;
+				restart_disk(); break;
+#endif
 				
 		}
 
@@ -248,6 +328,16 @@ int poll(void)
 
 #ifndef SIMULATION
 
+// save the catalog once the background scan has completed it, while no track plays
+static void save_catalog(void)
+{
+	if(indexed)
+	{
+		indexed=FALSE;
+		catalog_save();
+	}
+}
+
 // read a long from the file 
 static bool rdl(int fd,u32 *x)
 {
@@ -261,25 +351,44 @@ static bool rdw(int fd,u16 *x)
 }
 
 //
-// Stream wav file to DAC 
+// Stream wav (or FLAC) file to DAC 
 //
-static bool play_wav(char *file)
+static bool play_wav(int dirno,int trackno)
 {
 
-	u32 x,size,sample_rate;
-	u16 y,bits_per_sample;
-	bool rc;	
+	u32 x,size,left=0,sample_rate,fmt_size,fmt_read;
+	u16 block_align,tag,channels,bits_per_sample,frames,skip=0;
+	bool rc,sectors=FALSE;	
 	s16 *tbuffer;
-	u16 actual;
+	s16 actual;
     int fd=-1;
+	const sample_format *format=NULL;
+	s16 (*decoder)(s16 *block,u16 frames,int (*poll_fn)())=NULL;
 
 	rc=FALSE;
 
-	fd=open(file,O_RDONLY,0);
+	fd=open_track(dirno,trackno);
 	if(fd < 0)
 		goto  end;
 
-	if(!rdl(fd,&x) || x!=0x46464952)	// RIFF
+	if(!rdl(fd,&x))
+		goto   end;
+
+#ifdef FLAC_DECODER
+	// FLAC stream
+	if(x==FLAC_MARKER)
+	{
+		size=flac_start(&decoder_ram.flac,fd,&sample_rate);
+		if(!size)
+			goto   end;
+
+		set_dac_rate(sample_rate);
+		decoder=flac_read;
+		goto   stream;
+	}
+#endif
+
+	if(x!=0x46464952)	// RIFF
 		goto   end;
 
 	if(!rdl(fd,&size))
@@ -291,40 +400,97 @@ static bool play_wav(char *file)
 	if(!rdl(fd,&x) || x!=0x20746d66) // FMT
 		goto   end;
 
-	if(!rdl(fd,&x) || x!=16) // subchunk size
+	if(!rdl(fd,&fmt_size) || fmt_size<16) // subchunk size
 		goto   end;
 
-	if(!rdw(fd,&y) || y!=1) // audio format
+	if(!rdw(fd,&tag)) // audio format
 		goto   end;
 		 
-	if(!rdw(fd,&y) || y!=2)	// channels	.. must be stereo
+	if(!rdw(fd,&channels))
 		goto   end;
 
 	if(!rdl(fd,&sample_rate))
 		goto   end;
-
-	set_dac_rate(sample_rate);
  	
 	// skip byte rate
 	rdl(fd,&x);
-	// skip block align
-	rdw(fd,&y);
-	// bits per sample only likes 16 at the moment
-	if(!rdw(fd,&bits_per_sample) || bits_per_sample!=16)
+	if(!rdw(fd,&block_align))
 		goto   end;
 
-   	// chunk2
-	if(!rdl(fd,&x) || x!=0x61746164)
+	if(!rdw(fd,&bits_per_sample))
 		goto   end;
 
-	// size of sample data
-	if(!rdl(fd,&size))
+	fmt_read=16;
+
+	// WAVE_FORMAT_EXTENSIBLE has the actual format at the start of its subformat GUID
+	if(tag==WAVE_FORMAT_EXTENSIBLE && fmt_size>=40)
+	{
+		// skip extension size, valid bits and channel mask
+		lseek(fd, 8, SEEK_CUR);
+
+		if(!rdw(fd,&tag))
+			goto   end;
+
+		fmt_read=26;
+	}
+
+	// mono or stereo, 8, 16, 24 or 32-bit PCM, or float. IMA ADPCM is checked with
+	// the sample data
+	format=find_format(tag,channels,bits_per_sample);
+	if(format==NULL && tag!=WAVE_FORMAT_IMA_ADPCM)
 		goto   end;
 
-	// align file position on sector boundary
-	lseek(fd, 0, SEEK_SET);
+	set_dac_rate(sample_rate);
+
+	// skip the rest of the format chunk
+	if(lseek(fd, ((fmt_size + 1) & ~1) - fmt_read, SEEK_CUR) < 0)
+		goto   end;
+
+	// skip chunks (LIST, JUNK padding..) up to the sample data
+	for(;;)
+	{
+		if(!rdl(fd,&x) || !rdl(fd,&size))
+			goto   end;
 
-	size = size >> 9;
+		if(x==0x61746164)	// data
+			break;
+
+		if(lseek(fd, (size + 1) & ~1, SEEK_CUR) < 0)
+			goto   end;
+	}
+
+	// decode IMA ADPCM blocks
+	if(format==NULL)
+	{
+		size = adpcm_start(&decoder_ram.adpcm, fd, channels, block_align, bits_per_sample, size);
+		if(!size)
+			goto   end;
+
+		decoder=adpcm_read;
+	}
+	// stream stereo 16-bit samples from the sector holding the 1st one, silencing
+	// the bytes before it. Cards made by mkcard start the samples on a sector
+	// boundary. Samples off a word boundary would be split between words, so they
+	// are read like other formats
+	else if(format->convert==NULL && !((x = lseek(fd, 0, SEEK_CUR)) & 3))
+	{
+		lseek(fd, x & ~511, SEEK_SET);
+
+		// bytes from there to the end of the data chunk, in sectors rounded up
+		skip = x & 511;
+		left = size + skip;
+		size = (left + 511) >> 9;
+		sectors = TRUE;
+	}
+	// other formats are converted, a sample at a time
+	else
+		size /= format->frame_bytes;
+
+#ifdef FLAC_DECODER
+stream:
+#endif
+	// name it in the underrun log
+	set_audio_track(dirno,trackno);
 
 	// reset time mark
 	timemark = mark();
@@ -334,25 +500,72 @@ static bool play_wav(char *file)
    	// main streaming loop
 	while(size)
 	{
-		// request sample buffer from DAC data pump
+		// request free block of the output ring
 		tbuffer=get_buffer(poll);
 
 		// abort?
 		if(tbuffer==NULL)
 			break;
 
-		// load disk sectors directly into it
-		actual=read_sectors(fd, (u8 *)tbuffer, BUFSIZE>>8);
+		if(decoder!=NULL)
+		{
+			// decode compressed data into it, servicing commands while it loads
+			actual=decoder(tbuffer, size < BUFSIZE>>1 ? size : BUFSIZE>>1, poll);
+			frames=actual;
+		}
+		else if(sectors)
+		{
+			// load disk sectors directly into it, servicing commands meanwhile
+			actual=read_sectors(fd, (u8 *)tbuffer, size < BUFSIZE>>8 ? size : BUFSIZE>>8, poll);
+
+			// only the frames of the data chunk, the last sector may hold other chunks
+			x = actual > 0 ? (u32)actual<<9 : 0;
+			if(x > left)
+				x = left;
+			frames=x>>2;
+			left-=x;
+
+			// the 1st block starts with the end of the header
+			if(skip && actual > 0)
+			{
+				memset(tbuffer, 0, skip);
+				skip=0;
+			}
+		}
+		else
+		{
+			// read and convert samples into it
+			actual=read_frames(fd, tbuffer, size < BUFSIZE>>1 ? size : BUFSIZE>>1, format);
+			frames=actual;
+		}
+
+		// abort?
+		if(actual < 0)
+		{
+			tbuffer=NULL;
+			break;
+		}
 
 		// done track?
 		if(!actual)
 			break;
 
+		// silence the rest of a short last block
+		if(frames < BUFSIZE>>1)
+			memset((u8 *)tbuffer + (frames<<2), 0, (BUFSIZE<<1) - (frames<<2));
+
+		// queue it for output
+		commit_buffer();
+
 		// adjust length
 		size-=actual;
 	}
 
 	rc=TRUE;
+
+	// play out the end of the track
+	if(tbuffer!=NULL && !drain_buffers(poll))
+		tbuffer=NULL;
 	   
 	clear_buffers();
 
@@ -421,6 +634,14 @@ int main (int argc,char **argv)
 	{
  		if(TRUE==hd_bpb())	
 		{
+			// rescan the card only if the saved catalog is out of date. Only the
+			// list of directories and the 1st one are scanned before playing
+			if(!catalog_load())
+			{
+				catalog_start();
+				indexing=TRUE;
+			}
+
 			restart_disk();
 
 #endif
@@ -430,9 +651,15 @@ int main (int argc,char **argv)
 			 if(!playing) 
 			 	puts("Stopped\n\r");
 			 while(!playing)
+			 {
 				poll();
 #ifndef SIMULATION
-			 play_wav(file);
+				save_catalog();
+#endif
+			 }
+#ifndef SIMULATION
+			 play_wav(dirn,trackn);
+			 save_catalog();
 #endif
 			}	
 
@@ -8,13 +8,30 @@
 
 #include <LPC213x.H>                            /* LPC21xx definitions */ 
 #include <stdio.h>
+#include <string.h>
 #include "mmc.h"
 #include "types.h"
 #include "timing.h"
+#include "serial.h"
 	 
 #ifndef SIMULATION
 
-static u16 ReadTimeoutBytes;
+// SPI0 is clocked from the 15MHz VPB clock (60MHz CPU / 4)
+#define PCLK 15000000L
+
+// SPI clock dividers used during card identification (<= 400kHz) and the
+// fastest divider used on this board for data transfer
+#define SPI_INIT_DIVIDER	38
+#define SPI_MIN_DIVIDER		6
+
+static u32 ReadTimeoutBytes;
+static u32 WriteTimeoutBytes;
+
+// SDHC/SDXC cards are addressed in 512 byte blocks, older cards in bytes
+static bool BlockAddressing;
+
+// Read latency telemetry
+static mmc_stats Stats;
 
 static inline void spi_HOLD(void)
 {
@@ -38,7 +55,41 @@ static inline void spi_WRITE(u8 *buf,u16 len)
 	}
 }
 
-static inline void spi_READ(u8 *buf,u16 len)
+// Receive one byte of a burst into w at the given bit position and queue the next
+// transfer straight away, before the byte is stored
+#define SPI_RX_NEXT(w,shift)	{ while(!(S0SPSR & 128)) ; b=S0SPDR; S0SPDR = 0xff; w |= b << (shift); }
+
+// Sector payload receive kernel. Receives len bytes (a non-zero multiple of 4) into
+// a word aligned buffer, keeping the shift register busy and storing whole words
+static void spi_READ_WORDS(u32 *buf,u16 len)
+{
+	register u32 w,b;
+	register u16 n = len >> 2;
+
+	S0SPDR = 0xff;
+
+	while(--n)
+	{
+		w=0;
+		SPI_RX_NEXT(w,0);
+		SPI_RX_NEXT(w,8);
+		SPI_RX_NEXT(w,16);
+		SPI_RX_NEXT(w,24);
+		*buf++=w;
+	}
+
+	// last word, no further transfer is queued after its final byte
+	w=0;
+	SPI_RX_NEXT(w,0);
+	SPI_RX_NEXT(w,8);
+	SPI_RX_NEXT(w,16);
+	while(!(S0SPSR & 128)) ; 
+	b=S0SPDR;
+	*buf=w | (b << 24);
+}
+
+// Receive len bytes one at a time
+static inline void spi_READ_BYTES(u8 *buf,u16 len)
 {
 	while(len--)
 	{
@@ -48,6 +99,18 @@ static inline void spi_READ(u8 *buf,u16 len)
 	}
 }
 
+static inline void spi_READ(u8 *buf,u16 len)
+{
+	// bulk word aligned transfers use the unrolled kernel
+	if(len && !(len & 3) && !((u32)buf & 3))
+	{
+		spi_READ_WORDS((u32 *)buf,len);
+		return;
+	}
+
+	spi_READ_BYTES(buf,len);
+}
+
 static inline u16    spi_GetR1Response(void)
 {
     u16   x;
@@ -71,19 +134,16 @@ static inline u16    spi_GetR1Response(void)
 
 static u8 frame[6];
 
-
-static  inline u8    spi_CMD(u8 cmd,u32 data)
+// Send a command with a raw argument and CRC
+static  inline u8    spi_CMDARG(u8 cmd,u32 data,u8 crc)
 {
-
-	data <<= 9;
-
 	frame[1]=(u8)(data >> 24);
 	frame[2]=(u8)(data >> 16);
 	frame[3]=(u8)(data >> 8);
 	frame[4]=(u8)data;
 
 	frame[0]=cmd;
-	frame[5]=0xff;
+	frame[5]=crc;
 
     spi_WRITE(frame,6);
 
@@ -91,18 +151,63 @@ static  inline u8    spi_CMD(u8 cmd,u32 data)
     return  spi_GetR1Response();
 }
 
+// Send a command addressing the given sector
+static  inline u8    spi_CMD(u8 cmd,u32 data)
+{
+	if(!BlockAddressing)
+		data <<= 9;
+
+	return spi_CMDARG(cmd,data,0xff);
+}
+
+// Send an application specific command (CMD55 prefix), releasing the card afterwards
+static u8 spi_ACMD(u8 cmd,u32 data)
+{
+	u8 response,x;
+
+	spi_HOLD();
+	response = spi_CMDARG(0x77,0,0xff);
+	if(response <= 1)
+		response = spi_CMDARG(cmd,data,0xff);
+	spi_READ(&x,1);
+	spi_RELEASE();
+
+	return response;
+}
+
+// Wait for the start block token of a data block. Return TRUE if found
+static bool spi_WaitToken(void)
+{
+	u8 response;
+	u32 x;
+
+	for (x=0; x<ReadTimeoutBytes; x++)
+	{
+		spi_READ(&response,1);
+		if (response==0xFE)
+			return TRUE;
+	}
+
+	return FALSE;
+}
 
 #define INIT_TIMEOUT 5000
 
+// Card types found by mmc_Initialise()
+#define CT_MMC	0
+#define CT_SD1	1
+#define CT_SD2	2
+
 // Initialise the MMC controller. Return FALSE if not found
 bool mmc_Initialise(void)
 {
 	static const u32 time_exponent_lut[8] = { 1000000000L, 100000000L, 10000000L, 1000000L, 100000L, 10000, 1000, 100 };
 	static const u8 time_mantissa_lut[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
- 	u8 response,x,Nsac;
+	static const u32 rate_unit_lut[4] = { 10000L, 100000L, 1000000L, 10000000L };
+ 	u8 response,x,Nsac,type;
 	u16 timeout;
-	u32 Naac;
-  	u8 csd[16];
+	u32 Naac,hz,max_hz,timeout_bytes,limit_bytes;
+  	u8 csd[16],ocr[4];
 
    	
 	// Select SPI pin functions and P0.3 as the CS
@@ -113,44 +218,75 @@ bool mmc_Initialise(void)
 	IODIR0 |= 8;
 	spi_RELEASE();
 
-	// Select baud rate 125 kbps
-	S0SPCCR = 6; // 120; 
+	// Select identification baud rate (<= 400 kbps)
+	S0SPCCR = SPI_INIT_DIVIDER;
 
 	// Master, CPHA=1, CPOL=1, no IRQ,  MSB first
 	S0SPCR = 8+16+32;
 
+	BlockAddressing = FALSE;
+
 	// clock dummy bytes to initialise shift register on MMC card
 	x=0xff;
-	spi_WRITE(&x,1);
- 	spi_WRITE(&x,1);
+	for(timeout=0;timeout<10;timeout++)
+		spi_WRITE(&x,1);
  
 	delay_100ms();
 
+	// GO_IDLE_STATE (CMD0)
 	spi_HOLD();	
+	response=spi_CMDARG(0x40,0,0x95);
+	spi_READ(&x,1);
+	spi_RELEASE();
 
-	
-	frame[0]=0x40;
-	frame[1]=frame[2]=frame[3]=frame[4]=0;
-	frame[5]=0x95;
+	if(response != 1)
+		return FALSE;
 
-	spi_WRITE(frame,6);
-	response=spi_GetR1Response();
+	//
+	// SEND_IF_COND (CMD8) is only understood by version 2.00 SD cards, which
+	// must echo the check pattern and accept the 2.7-3.6V range
+	//
+	spi_HOLD();
+	response=spi_CMDARG(0x48,0x1AA,0x87);
+	if(response == 1)
+		spi_READ(ocr,4);
 	spi_READ(&x,1);
 	spi_RELEASE();
-	
+
+	if(response == 1)
+	{
+		if(ocr[2] != 0x01 || ocr[3] != 0xAA)
+			return FALSE;
+
+		type = CT_SD2;
+	}
+	else
+	{
+		// SD version 1 cards accept ACMD41, MMC cards reject it
+		response = spi_ACMD(0x69,0);
+		type = (response <= 1) ? CT_SD1 : CT_MMC;
+	}
+
 	//
-    // Now send CMD1 (SEND_OP_COND) command
+    // Now send ACMD41 (SD_SEND_OP_COND) or CMD1 (SEND_OP_COND)
     //
 	// Continue polling the device with this command until it clears the idle bit or we time out
 	//
 	timeout = 0;
+	response = 1;
 
     while ((response&1) && (timeout < INIT_TIMEOUT))
     {
-		spi_HOLD();
-   		response = spi_CMD(0x41,0);
-        spi_READ(&x,1);		// send 8 clocks after response sequence
-		spi_RELEASE();
+		if(type == CT_MMC)
+		{
+			spi_HOLD();
+   			response = spi_CMD(0x41,0);
+        	spi_READ(&x,1);		// send 8 clocks after response sequence
+			spi_RELEASE();
+		}
+		else
+			// announce high capacity support to version 2.00 cards
+			response = spi_ACMD(0x69,(type == CT_SD2) ? 0x40000000L : 0);
 
         if(response&1)
         {
@@ -166,26 +302,42 @@ bool mmc_Initialise(void)
 	    return FALSE;
 	}
 
+	if(type == CT_SD2)
+	{
+		// READ_OCR (CMD58). CCS set means the card uses block addressing
+		spi_HOLD();
+		response = spi_CMDARG(0x7A,0,0xff);
+		if(!response)
+			spi_READ(ocr,4);
+		spi_READ(&x,1);
+		spi_RELEASE();
+
+		if(response)
+			return FALSE;
+
+		BlockAddressing = (ocr[0] & 0x40) ? TRUE : FALSE;
+	}
+
+	if(!BlockAddressing)
+	{
+		// SET_BLOCKLEN (CMD16) so byte addressed cards transfer 512 byte blocks
+		spi_HOLD();
+		response = spi_CMDARG(0x50,512,0xff);
+		spi_READ(&x,1);
+		spi_RELEASE();
+
+		if(response)
+			return FALSE;
+	}
 
 	//
 	// Read the CSD structure
 	//
-	spi_HOLD();
-    response = spi_CMD(0x49,0);
-    if (!response)
-    {
-		// Command valid ... wait for READ Token
-        for (x=0; x<9; x++)
-        {
-            spi_READ(&response,1);
-            if (response!=0xff)
-                break;
-        }
+	ReadTimeoutBytes = 9;
 
-    }
-
-
-    if (response==0xFE)
+	spi_HOLD();
+    response = spi_CMDARG(0x49,0,0xff);
+    if (!response && spi_WaitToken())
     {
 		spi_READ(csd,16);
 
@@ -198,19 +350,69 @@ bool mmc_Initialise(void)
 
         spi_RELEASE();
 
-		// fetch raw Taac
+		// raise the SPI clock to the fastest rate TRAN_SPEED allows
+		x = csd[3];
+
+		// rate unit in bits 2..0, codes 4 to 7 are reserved: stay at the init clock
+		max_hz = (x & 7) < 4 ? rate_unit_lut[x & 7] * time_mantissa_lut[(x >> 3) & 15] : 0;
+		if(!max_hz)
+			max_hz = PCLK / SPI_INIT_DIVIDER;
 
-		x = csd[1] & 127;
+		Naac = (PCLK + max_hz - 1) / max_hz;
+		Naac = (Naac + 1) & ~1;
 
-		// work out Naac based on clock frequency and SPI frequency
+		if(Naac < SPI_MIN_DIVIDER)
+			Naac = SPI_MIN_DIVIDER;
+		if(Naac > 254)
+			Naac = 254;
 
-		Naac = ( time_mantissa_lut[(x >> 3) & 15] * 125000 )  / time_exponent_lut[x & 7] ;
+		S0SPCCR = Naac;
 
-		Nsac = csd[2] ;
+		hz = PCLK / Naac;
 
-		ReadTimeoutBytes = 1+(u16)((Naac + Nsac*1000)/8);
+		// 100ms worth of bytes, the maximum read access time of SD cards
+		limit_bytes = hz / 80;
 
-		puts("MMC OK\n");
+		if((csd[0] >> 6) == 1)
+		{
+			// version 2.00 CSD has a fixed access time, use the 100ms limit
+			timeout_bytes = limit_bytes;
+		}
+		else
+		{
+			// fetch raw Taac
+
+			x = csd[1] & 127;
+
+			// work out Naac based on the SPI frequency. The mantissa table holds 10 times
+			// the value, so Naac is in tenths of a clock. Nsac is in units of 100 clocks,
+			// Nsac*1000 in tenths too. Dividing tenths of clocks by 8 gives 10 times the
+			// access time in bytes
+
+			Naac = ( time_mantissa_lut[(x >> 3) & 15] * hz )  / time_exponent_lut[x & 7] ;
+
+			Nsac = csd[2] ;
+
+			timeout_bytes = (Naac + Nsac*1000)/8;
+
+			// SD cards allow 100 times the typical access time, MMC 10 times
+			if(type != CT_MMC)
+			{
+				timeout_bytes *= 10;
+				if(timeout_bytes > limit_bytes)
+					timeout_bytes = limit_bytes;
+			}
+		}
+
+		ReadTimeoutBytes = 1+timeout_bytes;
+
+		// 250ms worth of bytes, the maximum write busy time of SD cards
+		WriteTimeoutBytes = hz / 32;
+
+		mmc_ClearStats();
+		Stats.spi_hz = hz;
+
+		puts(BlockAddressing ? "SDHC OK\n" : "MMC OK\n");
 
         return  TRUE;
     }
@@ -221,53 +423,315 @@ bool mmc_Initialise(void)
 	return FALSE;
 }
 
-// Read a sector into the buffer
-bool mmc_SectorRead(u8 *sector,u32 lba)
+//
+// Asynchronous read engine. mmc_ReadStart() issues the command and each call to
+// mmc_ReadPoll() then waits up to MMC_POLL_BYTES byte-times for the start block
+// token, so the caller can service other work while the card looks up the data.
+// Once the token is in, the block is received whole : the card sends it without
+// gaps, so returning in the middle of it would only add poll overhead
+//
+#define MMC_POLL_BYTES 64
+
+// Read engine states
+#define RD_IDLE		0
+#define RD_TOKEN	1	// waiting for the start block token
+
+static u8 ReadState=RD_IDLE;
+static s8 ReadStatus=MMC_DONE;
+static bool ReadMulti;		// transfer uses CMD18 and must be ended with CMD12
+static u8 *ReadBuf;			// where the next block goes
+static u16 ReadBlocks;		// blocks left to transfer, including current one
+static u32 ReadWait;		// token poll bytes left before timing out
+
+// Record the token wait of a block, in byte-times
+static void mmc_LogWait(u32 wait)
+{
+	u8 bucket;
+	u32 w;
+
+	Stats.reads++;
+
+	if(wait > Stats.max_wait)
+		Stats.max_wait = wait;
+
+	// bucket n holds waits of 2^(n-1) to 2^n-1 byte-times
+	for(bucket=0,w=wait; w && bucket < MMC_LAT_BUCKETS-1; bucket++)
+		w >>= 1;
+
+	Stats.histogram[bucket]++;
+}
+
+// Terminate the transfer in flight and release the card
+static void mmc_ReadEnd(s8 status)
 {
 	u8 response;
-	register u8 *buf;
-	int x;
+	u32 x;
 
-	spi_HOLD();
-	response = spi_CMD(0x51,lba);
+	if(ReadMulti)
+	{
+		// STOP_TRANSMISSION (CMD12). Skip the stuff byte which follows the command
+		frame[0]=0x4C;
+		frame[1]=frame[2]=frame[3]=frame[4]=0;
+		frame[5]=0xff;
 
-    if (!response)
-    {   // Command valid ... wait for READ Token
-        for (x=0; x<ReadTimeoutBytes; x++)
-        {
-            spi_READ(&response,1);
-            if (response==0xFE)
-                break;
-        }
-    }
-    if (response==0xFE)
-    {
-		// Get the 512 bytes into our buffer!
-		buf=sector;
+		spi_WRITE(frame,6);
+		spi_READ(&response,1);
+		spi_GetR1Response();
 
-		for(x=0;x<512;x++)
+		// Wait for the card to leave the busy state
+		for (x=0; x<ReadTimeoutBytes; x++)
 		{
-			S0SPDR = 0xff;
-			while(!(S0SPSR & 128)) ; 
-			*buf++=S0SPDR;
+			spi_READ(&response,1);
+			if (response==0xFF)
+				break;
 		}
-        
-        // Get 2 more to clear CRC from MMC
-        spi_READ(&response,1);
-        spi_READ(&response,1);
-
+	}
+	else
+	{
 		// 8 clocks after read to keep MMC happy
         spi_READ(&response,1);
+	}
 
-        spi_RELEASE();
+	spi_RELEASE();
+
+	ReadState=RD_IDLE;
+	ReadStatus=status;
+}
+
+// Start reading count contiguous sectors into the buffer. Any transfer still in
+// flight is completed first. Returns FALSE if the card rejected the command
+bool mmc_ReadStart(u8 *sector,u32 lba,u16 count)
+{
+	u8 response;
+
+	mmc_ReadFinish();
+
+	ReadStatus=MMC_DONE;
+
+	if(!count)
+		return TRUE;
+
+	// READ_SINGLE_BLOCK (CMD17) or READ_MULTIPLE_BLOCK (CMD18)
+	ReadMulti = (count > 1);
+
+	spi_HOLD();
+	response = spi_CMD(ReadMulti ? 0x52 : 0x51,lba);
+
+	if(response)
+	{
+		spi_RELEASE();
+		Stats.rejected++;
+		ReadStatus=MMC_ERROR;
+		return FALSE;
+	}
+
+	ReadBuf=sector;
+	ReadBlocks=count;
+	ReadWait=ReadTimeoutBytes;
+	ReadState=RD_TOKEN;
+	ReadStatus=MMC_BUSY;
+
+	return TRUE;
+}
+
+// Advance the transfer in flight. Returns MMC_BUSY, MMC_DONE or MMC_ERROR
+s8 mmc_ReadPoll(void)
+{
+	u8 response;
+	u16 n;
+
+	if(ReadState != RD_TOKEN)
+		return ReadStatus;
+
+	// Each block arrives with its own READ Token
+	for(n=MMC_POLL_BYTES;n;n--)
+	{
+		spi_READ(&response,1);
+
+		if(response==0xFE)
+			break;
+
+		// Data error token
+		if(response!=0xFF)
+		{
+			Stats.bad_tokens++;
+			mmc_ReadEnd(MMC_ERROR);
+			return ReadStatus;
+		}
+
+		if(!--ReadWait)
+		{
+			Stats.timeouts++;
+			mmc_ReadEnd(MMC_ERROR);
+			return ReadStatus;
+		}
+	}
+
+	if(!n)
+		return ReadStatus;
+
+	mmc_LogWait(ReadTimeoutBytes - ReadWait);
+
+	spi_READ(ReadBuf,512);
+	ReadBuf+=512;
+
+	// Get 2 more to clear CRC from MMC
+	spi_READ(&response,1);
+	spi_READ(&response,1);
+
+	if(--ReadBlocks)
+		ReadWait=ReadTimeoutBytes;
+	else
+		mmc_ReadEnd(MMC_DONE);
+
+	return ReadStatus;
+}
+
+// Run the transfer in flight to completion. Returns MMC_DONE or MMC_ERROR
+s8 mmc_ReadFinish(void)
+{
+	while(ReadState != RD_IDLE)
+		mmc_ReadPoll();
+
+	return ReadStatus;
+}
+
+// No transfer in flight, so a new read won't have to wait for one
+bool mmc_ReadIdle(void)
+{
+	return ReadState == RD_IDLE;
+}
+
+// Read a sector into the buffer
+bool mmc_SectorRead(u8 *sector,u32 lba)
+{
+	return mmc_ReadStart(sector,lba,1) && mmc_ReadFinish()==MMC_DONE;
+}
+
+// Read a run of physically contiguous sectors into the buffer using a single
+// READ_MULTIPLE_BLOCK (CMD18), so the command and R1 overhead is paid once per run
+bool mmc_MultiSectorRead(u8 *sector,u32 lba,u16 count)
+{
+	return mmc_ReadStart(sector,lba,count) && mmc_ReadFinish()==MMC_DONE;
+}
+
+// Write a sector from the buffer
+bool mmc_SectorWrite(u8 *sector,u32 lba)
+{
+	static u8 token[2] = { 0xff, 0xfe };
+	u8 response,busy;
+	u32 x;
+	bool rc;
+
+	mmc_ReadFinish();
+
+	spi_HOLD();
+
+	// WRITE_BLOCK (CMD24)
+	response = spi_CMD(0x58,lba);
+
+	if (!response)
+	{
+		// One byte gap then the start block token, the payload and a dummy CRC
+		spi_WRITE(token,2);
+		spi_WRITE(sector,512);
+		spi_WRITE(token,1);
+		spi_WRITE(token,1);
+
+		// Data response token xxx0sss1, sss=010 when the data was accepted
+		spi_READ(&response,1);
+
+		// Wait for the card to finish programming
+		busy=0;
+		for (x=0; x<WriteTimeoutBytes && busy!=0xFF; x++)
+			spi_READ(&busy,1);
+
+		rc = (response & 0x1F) == 0x05 && busy == 0xFF;
+
+		// 8 clocks after write to keep MMC happy
+		spi_READ(&response,1);
+		spi_RELEASE();
+
+		return rc;
+	}
+
+	spi_RELEASE();
 
-        return  TRUE;
-    }
-  
-  	spi_RELEASE();
-		
 	return FALSE;
 }
 
-#endif
+// Copy out the read latency telemetry
+void mmc_GetStats(mmc_stats *stats)
+{
+	memcpy(stats,&Stats,sizeof(Stats));
+}
+
+// Clear the read latency telemetry
+void mmc_ClearStats(void)
+{
+	u32 hz = Stats.spi_hz;
 
+	memset(&Stats,0,sizeof(Stats));
+
+	Stats.spi_hz = hz;
+	Stats.timeout = ReadTimeoutBytes;
+}
+
+// Dump the read latency telemetry on the serial console
+void mmc_DumpStats(void)
+{
+	u8 i;
+
+	puts("Reads ");			puts(itoa(Stats.reads,32));
+	puts(" Timeouts ");		puts(itoa(Stats.timeouts,32));
+	puts(" Bad tokens ");	puts(itoa(Stats.bad_tokens,32));
+	puts(" Rejected ");		puts(itoa(Stats.rejected,32));
+	puts("\n\rMax wait ");	puts(itoa(Stats.max_wait,32));
+	puts(" of ");			puts(itoa(Stats.timeout,32));
+	puts(" bytes");
+
+	if(Stats.spi_hz)
+	{
+		puts(", ");			puts(itoa((Stats.max_wait * 8000) / (Stats.spi_hz / 1000),32));
+		puts(" us");
+	}
+
+	puts("\n\r");
+
+	for(i=0;i<MMC_LAT_BUCKETS;i++)
+	{
+		puts(itoa(i,8));
+		puts(": ");
+		puts(itoa(Stats.histogram[i],32));
+		puts("\n\r");
+	}
+}
+
+// sector buffer lent by the caller
+static u32 *BenchBuf;
+
+static void mmc_BenchWords(void)
+{
+	spi_READ_WORDS(BenchBuf,512);
+}
+
+static void mmc_BenchBytes(void)
+{
+	spi_READ_BYTES((u8 *)BenchBuf,512);
+}
+
+// CPU cycles to receive a sector payload at the current SPI clock, with the unrolled
+// word kernel (words TRUE) or the byte loop. The card is deselected, so it ignores
+// the bytes clocked. buf takes the 512 bytes received. Stops output
+u32 mmc_BenchRead(bool words,u32 *buf)
+{
+	BenchBuf = buf;
+
+	mmc_ReadFinish();
+
+	spi_RELEASE();
+
+	return time_cycles(words ? mmc_BenchWords : mmc_BenchBytes);
+}
+
+#endif
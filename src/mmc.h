@@ -12,9 +12,54 @@
 
 #include "types.h"
 
+// Status of an asynchronous read
+#define MMC_BUSY	0
+#define MMC_DONE	1
+#define MMC_ERROR	(-1)
+
+// Number of buckets in the read latency histogram
+#define MMC_LAT_BUCKETS 16
+
+// Read latency telemetry. Waits are for the start block token, in SPI byte-times
+typedef struct
+{
+	u32 reads;			// blocks received
+	u32 timeouts;		// token waits which reached the read timeout
+	u32 bad_tokens;		// data error tokens received
+	u32 rejected;		// read commands rejected by the card
+	u32 max_wait;		// longest token wait
+	u32 timeout;		// token wait limit (ReadTimeoutBytes)
+	u32 spi_hz;			// SPI clock, to convert byte-times to time
+	u32 histogram[MMC_LAT_BUCKETS];	// bucket n counts waits of 2^(n-1) .. 2^n-1 byte-times
+} mmc_stats;
+
 bool mmc_Initialise(void);
 
 bool mmc_SectorRead(u8 *sector,u32 lba);
 
+bool mmc_MultiSectorRead(u8 *sector,u32 lba,u16 count);
+
+bool mmc_SectorWrite(u8 *sector,u32 lba);
+
+// Asynchronous reads: start a transfer, then poll it until it is no longer MMC_BUSY
+bool mmc_ReadStart(u8 *sector,u32 lba,u16 count);
+
+s8 mmc_ReadPoll(void);
+
+s8 mmc_ReadFinish(void);
+
+bool mmc_ReadIdle(void);
+
+// Read latency telemetry
+void mmc_GetStats(mmc_stats *stats);
+
+void mmc_ClearStats(void);
+
+void mmc_DumpStats(void);
+
+// CPU cycles to receive a sector payload into buf with the word kernel or the byte loop.
+// Stops output
+u32 mmc_BenchRead(bool words,u32 *buf);
+
 #endif
 
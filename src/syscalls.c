@@ -25,17 +25,16 @@ int isatty (int fd) {
   return 1;
 }
 
-#define HEAP_LIMIT 0x40008000
-
 caddr_t sbrk (int incr) {
   extern char   end asm ("end");	/* Defined by the linker */
+  extern char   stack_limit asm ("Stack_Limit");	/* Stacks above, see Startup.s */
   static char * heap_end;
          char * prev_heap_end;
 
   if (heap_end == NULL) heap_end = &end;
   prev_heap_end = heap_end;
   
-  if (heap_end + incr >= (char *)HEAP_LIMIT) {
+  if (heap_end + incr > &stack_limit) {
     abort ();	   /* Out of Memory */ 
   }  
   heap_end += incr;
@@ -0,0 +1,374 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  CARD.C:  SD/MMC card emulator in SPI mode, backed by an image file
+**
+**  Each byte mmc.c exchanges on SPI0 goes through card_xfer(). Commands are taken
+**  from the bytes clocked in, and the card's output is a run of 0xFF (the access
+**  time before a data token, or NCR before a response), then the queued bytes, then
+**  0x00 while programming, then 0xFF. Reads queue a block when the response or the
+**  last block has been clocked out, until STOP_TRANSMISSION for multiple block reads
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include "card.h"
+
+#define BLOCKSIZE	512
+
+card_stats card;
+
+static card_config cfg;
+static FILE *img;
+static u32 blocks;			// blocks in the image
+static u32 data_lba;		// 1st block of the data area of the 1st partition, if FAT16
+
+// command reception
+static u8 cmd[6];
+static u8 cmd_len;
+static bool idle,app;		// in idle state, CMD55 received
+static u8 init_tries;		// ACMD41 / CMD1 before leaving the idle state
+
+// output
+static u32 wait;			// 0xFF bytes before the queued bytes
+static u8 out[BLOCKSIZE + 8];
+static u16 out_len,out_pos;
+static u32 busy;			// 0x00 bytes after the queued bytes
+static u8 reading;			// blocks to queue : 0 none, 1 the single block, 2 until STOP_TRANSMISSION
+static u32 next_lba;		// next block queued
+
+// write reception
+static u8 wr_state;			// 0 none, 1 waiting for the start token, 2 receiving
+static u32 wr_lba;
+static u8 wr_buf[BLOCKSIZE + 2];
+static u16 wr_len;
+
+bool card_open(const char *image,const card_config *config)
+{
+	u32 lba;
+
+	if (!(img = fopen(image, "r+b")))
+		return FALSE;
+
+	fseeko(img, 0, SEEK_END);
+	blocks = (u32) (ftello(img) / BLOCKSIZE);
+
+	// the data area follows the reserved sectors, the FATs and the root directory
+	data_lba = 0;
+	fseeko(img, 0, SEEK_SET);
+
+	if (fread(out, 1, BLOCKSIZE, img) == BLOCKSIZE)
+	{
+		lba = out[454] | (out[455] << 8) | (out[456] << 16) | ((u32) out[457] << 24);
+
+		if (!fseeko(img, (off_t) lba * BLOCKSIZE, SEEK_SET) && fread(out, 1, BLOCKSIZE, img) == BLOCKSIZE)
+			data_lba = lba + (out[14] | (out[15] << 8)) + out[16] * (out[22] | (out[23] << 8)) + (out[17] | (out[18] << 8)) / 16;
+	}
+
+	cfg = *config;
+
+	idle = TRUE;
+	app = FALSE;
+	init_tries = 2;
+	cmd_len = 0;
+	wait = out_len = out_pos = busy = reading = 0;
+	wr_state = 0;
+
+	card_clear();
+
+	return TRUE;
+}
+
+void card_close(void)
+{
+	if (img)
+		fclose(img);
+
+	img = NULL;
+}
+
+void card_set(const card_config *config)
+{
+	cfg = *config;
+}
+
+void card_clear(void)
+{
+	memset(&card, 0, sizeof(card));
+}
+
+static void respond(u8 r1)	// queue R1 after one byte of NCR
+{
+	wait = 1;
+	out[0] = r1;
+	out_len = 1;
+	out_pos = 0;
+	busy = 0;
+}
+
+static void queue_block(u32 lba)	// queue the data token, block and CRC after the access time
+{
+	wait = cfg.stall_every && !(lba % cfg.stall_every) ? cfg.stall : cfg.access;
+	out_pos = 0;
+
+	if (lba >= blocks || (cfg.error_every && !(lba % cfg.error_every)))
+	{
+		out[0] = lba >= blocks ? 0x08 : 0x02;		// data error token : out of range, or CC error
+		out_len = 1;
+		reading = 0;
+		return;
+	}
+
+	out[0] = 0xFE;
+	memset(out + 1, 0, BLOCKSIZE);
+	fseeko(img, (off_t) lba * BLOCKSIZE, SEEK_SET);
+	if (fread(out + 1, 1, BLOCKSIZE, img) != BLOCKSIZE)
+		memset(out + 1, 0, BLOCKSIZE);
+	out[BLOCKSIZE + 1] = out[BLOCKSIZE + 2] = 0xFF;		// CRC, not checked in SPI mode
+	out_len = BLOCKSIZE + 3;
+}
+
+static bool address(u32 arg, u32 *lba)	// block of a command argument. FALSE if misaligned
+{
+	if (cfg.type == CARD_SDHC)
+	{
+		*lba = arg;
+		return TRUE;
+	}
+
+	*lba = arg / BLOCKSIZE;
+
+	return !(arg % BLOCKSIZE);
+}
+
+static void command(void)
+{
+	u8 index = cmd[0] & 63, r1;
+	u32 arg = ((u32) cmd[1] << 24) | ((u32) cmd[2] << 16) | ((u32) cmd[3] << 8) | cmd[4], lba;
+	bool acmd = app;
+
+	card.commands[index]++;
+	app = FALSE;
+
+	// any command ends a read, STOP_TRANSMISSION answers after a stuff byte
+	reading = 0;
+
+	if (index == 12)
+	{
+		respond(0);
+		wait = 0;
+		out[0] = 0xFF;
+		out[1] = 0;
+		out_len = 2;
+		busy = 2;
+		return;
+	}
+
+	r1 = idle ? 0x01 : 0;
+
+	switch (index)
+	{
+		case 0:		// GO_IDLE_STATE
+			idle = TRUE;
+			init_tries = 2;
+			respond(0x01);
+			break;
+
+		case 1:		// SEND_OP_COND, MMC
+			if (cfg.type != CARD_MMC)
+			{
+				respond(r1 | 0x04);
+				break;
+			}
+			if (!--init_tries)
+				idle = FALSE;
+			respond(idle ? 0x01 : 0);
+			break;
+
+		case 8:		// SEND_IF_COND, version 2.00 cards echo the pattern
+			if (cfg.type != CARD_SDHC)
+			{
+				respond(r1 | 0x04);
+				break;
+			}
+			respond(r1);
+			out[1] = 0;
+			out[2] = 0;
+			out[3] = (u8) (arg >> 8) & 15;
+			out[4] = (u8) arg;
+			out_len = 5;
+			break;
+
+		case 9:		// SEND_CSD
+			respond(r1);
+			memset(out + 1, 0xFF, 2);
+			out[3] = 0xFE;
+			memset(out + 4, 0, 16);
+			if (cfg.type == CARD_SDHC)
+			{
+				out[4] = 0x40;		// CSD version 2.00
+				out[5] = 0x0E;		// TAAC 1ms
+			}
+			else
+				out[5] = 0x26;		// TAAC 1.5ms
+			out[6] = 0;				// NSAC
+			out[7] = 0x32;			// TRAN_SPEED 25MHz
+			out[20] = out[21] = 0xFF;
+			out_len = 22;
+			break;
+
+		case 12:
+			break;
+
+		case 16:	// SET_BLOCKLEN
+			respond(arg == BLOCKSIZE ? r1 : r1 | 0x40);
+			break;
+
+		case 17:	// READ_SINGLE_BLOCK
+		case 18:	// READ_MULTIPLE_BLOCK
+			if (idle || !address(arg, &lba))
+			{
+				respond(r1 | 0x20);
+				break;
+			}
+			respond(0);
+			if (lba < data_lba)
+				card.fat_reads++;
+			next_lba = lba;
+			reading = index == 18 ? 2 : 1;
+			break;
+
+		case 24:	// WRITE_BLOCK
+			if (idle || !address(arg, &wr_lba))
+			{
+				respond(r1 | 0x20);
+				break;
+			}
+			respond(0);
+			wr_state = 1;
+			break;
+
+		case 41:	// SD_SEND_OP_COND
+			if (!acmd || cfg.type == CARD_MMC)
+			{
+				respond(r1 | 0x04);
+				break;
+			}
+			if (!--init_tries)
+				idle = FALSE;
+			respond(idle ? 0x01 : 0);
+			break;
+
+		case 55:	// APP_CMD
+			app = TRUE;
+			respond(r1);
+			break;
+
+		case 58:	// READ_OCR
+			respond(r1);
+			out[1] = 0x80 | (cfg.type == CARD_SDHC && !idle ? 0x40 : 0);
+			out[2] = 0xFF;
+			out[3] = 0x80;
+			out[4] = 0;
+			out_len = 5;
+			break;
+
+		default:
+			respond(r1 | 0x04);		// illegal command
+	}
+}
+
+static void write_byte(u8 b)	// take a byte of a WRITE_BLOCK data packet
+{
+	if (wr_state == 1)
+	{
+		if (b == 0xFE)
+		{
+			wr_state = 2;
+			wr_len = 0;
+		}
+		return;
+	}
+
+	wr_buf[wr_len++] = b;
+
+	if (wr_len < BLOCKSIZE + 2)
+		return;
+
+	wr_state = 0;
+
+	// data accepted, then busy while programming
+	wait = 0;
+	out[0] = 0x05;
+	out_len = 1;
+	out_pos = 0;
+	busy = 8;
+
+	if (wr_lba < blocks)
+	{
+		fseeko(img, (off_t) wr_lba * BLOCKSIZE, SEEK_SET);
+		fwrite(wr_buf, 1, BLOCKSIZE, img);
+		fflush(img);
+		card.blocks_written++;
+	}
+	else
+		out[0] = 0x0D;		// write error
+}
+
+u8 card_xfer(u8 in)
+{
+	u8 b;
+
+	card.bytes++;
+
+	// output
+	if (wait)
+	{
+		wait--;
+		b = 0xFF;
+	}
+	else if (out_pos < out_len)
+	{
+		b = out[out_pos++];
+
+		// blocks are counted once clocked out up to their CRC
+		if (out_pos == BLOCKSIZE + 3 && out[0] == 0xFE)
+			card.blocks_read++;
+	}
+	else if (busy)
+	{
+		busy--;
+		b = 0;
+	}
+	else
+		b = 0xFF;
+
+	// the next block to read once the response or the last block is out
+	if (reading && !wait && out_pos == out_len)
+	{
+		if (reading == 1)
+			reading = 0;
+
+		queue_block(next_lba++);
+	}
+
+	// input
+	if (wr_state)
+		write_byte(in);
+	else if (cmd_len || (in & 0xC0) == 0x40)
+	{
+		cmd[cmd_len++] = in;
+
+		if (cmd_len == 6)
+		{
+			cmd_len = 0;
+			command();
+		}
+	}
+
+	return b;
+}
@@ -0,0 +1,56 @@
+#ifndef _CARD_H
+#define _CARD_H
+
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  Card emulator for host builds
+*/
+
+#include "types.h"
+
+// Card types
+#define CARD_SDHC	0	// version 2.00, block addressed
+#define CARD_SDSC	1	// version 1, byte addressed
+#define CARD_MMC	2	// MMC, byte addressed
+
+typedef struct
+{
+	u8 type;			// CARD_xxx
+	u32 access;			// byte-times before the data token of each block read
+
+	// Housekeeping stalls and read errors, on the blocks whose address is a multiple
+	// of stall_every or error_every (0 for none)
+	u32 stall_every;
+	u32 stall;			// byte-times before the data token of a stalled block
+	u32 error_every;	// these blocks get a data error token
+} card_config;
+
+// Counters since card_open() or card_clear()
+typedef struct
+{
+	u32 commands[64];	// commands received, by index (17 READ_SINGLE_BLOCK, 18 READ_MULTIPLE_BLOCK..)
+	u32 fat_reads;		// read commands below the data area of a FAT16 image (FATs, root directory)
+	u32 blocks_read;		// blocks clocked out in full
+	u32 blocks_written;
+	u32 bytes;			// SPI byte-times, at the clock set in S0SPCCR
+} card_stats;
+
+extern card_stats card;
+
+// Emulate a card holding the image file. FALSE if it cannot be opened
+bool card_open(const char *image,const card_config *config);
+
+void card_close(void);
+
+// Change the timing and errors of the card, which keeps its state
+void card_set(const card_config *config);
+
+void card_clear(void);
+
+// Exchange a byte with the card : out is clocked in, the return value out
+u8 card_xfer(u8 out);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  CARDTEST.C:  card read tests, FFs.c and mmc.c against the card emulator
+**
+**  Usage : cardtest [-t type] [-c sectors] [-f clusters] [-l] image
+**
+**  image is written by mkimage, with the same -c and -f. type is the card
+**  emulated : 0 SDHC, 1 SDSC, 2 MMC.
+**
+**  Every track is streamed in the refills play_wav() uses. Each refill must
+**  issue one read command per contiguous run it touches, READ_MULTIPLE_BLOCK
+**  for runs of more than one sector, and the card must send exactly the
+**  sectors asked for. Runs past the FILE_MAX_EXTENTS the file handle maps are
+**  only known a cluster at a time. The data is checked against the pattern
+**  mkimage wrote.
+**
+**  -l then checks the read latency telemetry of mmc.c, with the card stalling
+**  below and past the read timeout, and sending data error tokens.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "card.h"
+#include "image.h"
+#include "ffs.h"
+#include "mmc.h"
+#include "timing.h"
+#include "types.h"
+
+#define REFILL	(BUFSIZE >> 8)		// sectors per read_sectors() in play_wav()
+
+static int errors;
+static u32 polls;
+
+// stands in for the player's poll(), which read_sectors() calls while the card transfers
+static int poll(void)
+{
+	polls++;
+
+	return 0;
+}
+
+static void fail(const char *what, s16 dir, s16 track, u32 refill)
+{
+	if (errors++ < 10)
+		printf("track %d of directory %d, refill %u : %s\n", track, dir, refill, what);
+}
+
+// Stream every track, checking the commands of each refill. Tracks are in runs of
+// run sectors (0 if contiguous), of clusters of spc sectors
+static void test_refills(u32 spc, u32 run)
+{
+	static u8 buffer[REFILL * 512];
+	char dirname[16], filename[16];
+	s16 dirs, tracks, d, t, n;
+	u32 track, offset, sector, end, refills = 0, cmd17 = 0, cmd18 = 0, got17 = 0, got18 = 0, sectors = 0, fat, i;
+	card_stats before;
+	s8 fd;
+
+	dirs = scan_dirs(-1, dirname);
+
+	for (d = 0 ; d <= dirs ; d++)
+	{
+		tracks = scan_tracks(d, -1, filename, dirname);
+
+		for (t = 1 ; t <= tracks ; t++)
+		{
+			track = (d ? d - 1 : 0) * tracks + t - 1;
+
+			if ((fd = open_track(d, t)) < 0)
+			{
+				fail("cannot open", d, t, 0);
+				continue;
+			}
+
+			for (offset = 0 ; ; offset += n << 9, refills++)
+			{
+				before = card;
+
+				if ((n = read_sectors(fd, buffer, REFILL, poll)) <= 0)
+					break;
+
+				// expected commands : the refill split at run boundaries
+				sector = offset >> 9;
+				end = sector + n;
+				for (i = 0 ; sector < end ; i++)
+				{
+					u32 piece = !run ? end : sector / run < FILE_MAX_EXTENTS ? (sector / run + 1) * run : (sector / spc + 1) * spc;
+
+					piece = (piece < end ? piece : end) - sector;
+
+					if (piece == 1)
+						cmd17++;
+					else
+						cmd18++;
+
+					sector += piece;
+				}
+
+				// FAT sectors read to follow the cluster chain are not counted
+				fat = card.fat_reads - before.fat_reads;
+				got17 += card.commands[17] - before.commands[17] - fat;
+				got18 += card.commands[18] - before.commands[18];
+
+				if (card.commands[17] - before.commands[17] + card.commands[18] - before.commands[18] - fat != i)
+					fail("wrong count of read commands", d, t, offset >> 9);
+
+				if (card.blocks_read - before.blocks_read - fat != (u32) n)
+					fail("wrong count of blocks sent", d, t, offset >> 9);
+
+				for (i = 0 ; i < (u32) n << 9 ; i++)
+					if (offset + i >= IMAGE_HEADER && buffer[i] != IMAGE_BYTE(track, offset + i))
+					{
+						fail("wrong data", d, t, offset >> 9);
+						break;
+					}
+
+				sectors += n;
+			}
+
+			close(fd);
+		}
+	}
+
+	printf("%u refills of up to %u sectors, %u sectors : %.2f commands per refill, %.2f polls per sector\n",
+		refills, REFILL, sectors, (double) (got17 + got18) / refills, (double) polls / sectors);
+
+	if (got17 != cmd17 || got18 != cmd18)
+	{
+		printf("%u CMD17 and %u CMD18, expected %u and %u\n", got17, got18, cmd17, cmd18);
+		errors++;
+	}
+}
+
+// Histogram bucket of a token wait, as mmc.c counts it
+static u8 bucket(u32 wait)
+{
+	u8 n;
+
+	for (n = 0 ; wait && n < MMC_LAT_BUCKETS - 1 ; n++)
+		wait >>= 1;
+
+	return n;
+}
+
+// Read 256 blocks from block 1024 as 4 block transfers, with the card set up as config
+// so that failures hit the 1st block of a transfer. Check the telemetry against the
+// transfers which failed by timeout or bad token, and the waits longer than the access
+static void test_latency(const card_config *config, const char *what, u32 timeouts, u32 bad_tokens, u32 waits, u32 wait)
+{
+	static u8 buffer[4 * 512];
+	mmc_stats stats;
+	u32 i, n = 0;
+	bool ok = TRUE;
+
+	card_set(config);
+	mmc_ClearStats();
+
+	for (i = 0 ; i < 256 ; i += 4)
+		if (!mmc_MultiSectorRead(buffer, 1024 + i, 4))
+			n++;
+
+	mmc_GetStats(&stats);
+
+	if (n != timeouts + bad_tokens || stats.timeouts != timeouts || stats.bad_tokens != bad_tokens)
+		ok = FALSE;
+	if (stats.reads != 256 - 4 * n)
+		ok = FALSE;
+	if (stats.histogram[bucket(config->access)] != stats.reads - waits)
+		ok = FALSE;
+	if (waits && (stats.histogram[bucket(wait)] != waits || stats.max_wait != wait))
+		ok = FALSE;
+
+	printf("%s : %u failed transfers, %u reads, %u timeouts, %u bad tokens, longest wait %u of %u bytes\n",
+		what, n, stats.reads, stats.timeouts, stats.bad_tokens, stats.max_wait, stats.timeout);
+
+	if (!ok)
+	{
+		mmc_DumpStats();
+		printf("FAILED, expected %u timeouts, %u bad tokens, %u waits of %u bytes\n", timeouts, bad_tokens, waits, wait);
+		errors++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	card_config config = { CARD_SDHC, 100 };
+	u32 spc = 8, fragment = 0;
+	bool latency = FALSE;
+	mmc_stats stats;
+	int a;
+
+	for (a = 1 ; a < argc - 1 ; a++)
+	{
+		if (!strcmp(argv[a], "-t") && a + 1 < argc - 1)
+			config.type = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-c") && a + 1 < argc - 1)
+			spc = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-f") && a + 1 < argc - 1)
+			fragment = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-l"))
+			latency = TRUE;
+		else
+			break;
+	}
+
+	if (a != argc - 1)
+	{
+		fprintf(stderr, "usage: cardtest [-t type] [-c sectors] [-f clusters] [-l] image\n");
+		return 1;
+	}
+
+	if (!card_open(argv[a], &config) || !mmc_Initialise() || !hd_mbr() || !hd_bpb())
+	{
+		fprintf(stderr, "cardtest: no card\n");
+		return 1;
+	}
+
+	catalog_build();
+
+	test_refills(spc, spc * fragment);
+
+	if (latency)
+	{
+		mmc_GetStats(&stats);
+
+		// every 16th block stalls for half the timeout
+		config.stall_every = 16;
+		config.stall = stats.timeout / 2;
+		test_latency(&config, "stalls", 0, 0, 16, config.stall);
+
+		// every 64th block for longer than the timeout
+		config.stall_every = 64;
+		config.stall = stats.timeout + 100;
+		test_latency(&config, "timeouts", 4, 0, 0, 0);
+
+		// every 64th block gets a data error token
+		config.stall_every = 0;
+		config.error_every = 64;
+		test_latency(&config, "errors", 0, 4, 0, 0);
+
+		// and the card is read as before
+		config.error_every = 0;
+		test_latency(&config, "recovered", 0, 0, 0, 0);
+	}
+
+	card_close();
+
+	if (errors)
+		printf("FAILED, %d errors\n", errors);
+
+	return errors != 0;
+}
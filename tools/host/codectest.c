@@ -0,0 +1,272 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  CODECTEST.C:  decoder tests, adpcm.c and flac.c reading a card image through
+**  FFs.c and mmc.c
+**
+**  Usage : codectest image expected_dir
+**
+**  image is written by mkcard from the streams of mkadpcm and mkflac, expected_dir
+**  holds the samples they decode to. Every track is decoded as play_wav() does, once in the
+**  blocks of the output ring and once in blocks of 37 samples, splitting codec
+**  blocks anywhere, and must match the expected samples exactly.
+**
+**  For each track : the card bandwidth it takes at its sample rate, as SPI bytes
+**  including command and token overhead, and the wall time per sample on this PC.
+**  Cycles on the target are timed by the player's 'a' and 'f' commands, whose
+**  FLAC frame is also decoded here.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "card.h"
+#include "adpcm.h"
+#include "flac.h"
+#include "ffs.h"
+#include "mmc.h"
+#include "timing.h"
+#include "types.h"
+
+#define WAVE_FORMAT_IMA_ADPCM	0x0011
+
+#define ODD_BLOCK	37		// samples per call of the 2nd pass
+
+// RAM of the decoders, as main.c lends it
+static union
+{
+	adpcm_ram adpcm;
+	flac_ram flac;
+} decoder_ram;
+
+static int errors;
+
+// stands in for the player's poll()
+static int poll(void)
+{
+	return 0;
+}
+
+static bool rdl(s8 fd, u32 *x)
+{
+	return read(fd, (u8 *) x, 4) == 4;
+}
+
+static bool rdw(s8 fd, u16 *x)
+{
+	return read(fd, (u8 *) x, 2) == 2;
+}
+
+// Open a track and start its decoder, as play_wav() does. Returns the decoder, its
+// sample count and rate, and what it plays in format
+static s16 (*start(s16 d, s16 t, s8 *fd, u32 *size, u32 *rate, char *format))(s16 *, u16, int (*)())
+{
+	u32 x, fmt_size;
+	u16 tag, channels, block_align, bits;
+
+	u8 info[22];
+
+	if ((*fd = open_track(d, t)) < 0)
+		return NULL;
+
+	// FLAC, STREAMINFO is the 1st metadata block
+	if (read(*fd, info, sizeof(info)) == sizeof(info) && !memcmp(info, "fLaC", 4))
+	{
+		sprintf(format, "FLAC %u ch %u bit", ((info[20] >> 1) & 7) + 1, ((info[20] & 1) << 4 | info[21] >> 4) + 1);
+
+		*size = flac_start(&decoder_ram.flac, *fd, rate);
+
+		return *size ? flac_read : NULL;
+	}
+
+	lseek(*fd, 0, SEEK_SET);
+
+	if (!rdl(*fd, &x) || x != 0x46464952 || !rdl(*fd, size) || !rdl(*fd, &x) || x != 0x45564157)
+		return NULL;
+
+	if (!rdl(*fd, &x) || x != 0x20746d66 || !rdl(*fd, &fmt_size) || fmt_size < 16)
+		return NULL;
+
+	if (!rdw(*fd, &tag) || !rdw(*fd, &channels) || !rdl(*fd, rate) || !rdl(*fd, &x) ||
+		!rdw(*fd, &block_align) || !rdw(*fd, &bits) || tag != WAVE_FORMAT_IMA_ADPCM)
+		return NULL;
+
+	lseek(*fd, ((fmt_size + 1) & ~1) - 16, SEEK_CUR);
+
+	for (;;)
+	{
+		if (!rdl(*fd, &x) || !rdl(*fd, size))
+			return NULL;
+
+		if (x == 0x61746164)	// data
+			break;
+
+		lseek(*fd, (*size + 1) & ~1, SEEK_CUR);
+	}
+
+	sprintf(format, "ADPCM %u ch %u", channels, block_align);
+
+	*size = adpcm_start(&decoder_ram.adpcm, *fd, channels, block_align, bits, *size);
+
+	return *size ? adpcm_read : NULL;
+}
+
+// the expected samples of a track, from expected_dir/<name>.PCM
+static s16 *expected(const char *dir, const char *filename, u32 *samples)
+{
+	char path[512], name[16];
+	s16 *pcm;
+	long bytes;
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s", filename);
+	if (strchr(name, '.'))
+		*strchr(name, '.') = 0;
+
+	snprintf(path, sizeof(path), "%s/%s.PCM", dir, name);
+
+	if (!(f = fopen(path, "rb")))
+		return NULL;
+
+	fseek(f, 0, 2);		// SEEK_END of the C library, ffs.h has its own
+	bytes = ftell(f);
+	rewind(f);
+
+	pcm = malloc(bytes + 4);
+	*samples = fread(pcm, 4, bytes / 4, f);
+	fclose(f);
+
+	return pcm;
+}
+
+// Decode a track in calls of up to block samples, comparing with pcm
+static void test_track(s16 d, s16 t, const char *filename, const s16 *pcm, u32 samples, u16 block, bool report)
+{
+	static s16 out[BUFSIZE];
+	s16 (*decoder)(s16 *, u16, int (*)());
+	u32 size, rate = 0, done = 0, bad = 0, first = 0, i;
+	card_stats before = card;
+	struct timespec t0, t1;
+	char format[32];
+	double us;
+	s16 n;
+	s8 fd;
+
+	if (!(decoder = start(d, t, &fd, &size, &rate, format)))
+	{
+		printf("%s : not played\n", filename);
+		errors++;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	while (size)
+	{
+		n = decoder(out, size < block ? size : block, poll);
+
+		if (n <= 0)
+			break;
+
+		for (i = 0 ; i < (u32) n * 2 ; i++)
+			if (done * 2 + i >= samples * 2 || out[i] != pcm[done * 2 + i])
+				if (!bad++)
+					first = done + i / 2;
+
+		done += n;
+		size -= n;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	close(fd);
+
+	us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+
+	if (bad || done != samples)
+	{
+		printf("%s in blocks of %u : %u of %u samples, %u wrong from sample %u\n", filename, block, done, samples, bad, first);
+		errors++;
+	}
+	else if (report)
+		printf("%-12s %-16s %6u %8u %9u %6.1f %% %9.1f\n", filename, format, rate, done,
+			(u32) ((double) (card.bytes - before.bytes) * rate / done / 1024),
+			(card.bytes - before.bytes) * 25.0 / done, us * 1000 / done);
+}
+
+int main(int argc, char **argv)
+{
+	card_config config = { CARD_SDHC, 100 };
+	char dirname[16], filename[16];
+	struct timespec t0, t1;
+	s16 dirs, tracks, d, t;
+	u32 samples;
+	s16 *pcm;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: codectest image expected_dir\n");
+		return 1;
+	}
+
+	if (!card_open(argv[1], &config) || !mmc_Initialise() || !hd_mbr() || !hd_bpb())
+	{
+		fprintf(stderr, "codectest: no card\n");
+		return 1;
+	}
+
+	// mkcard writes the catalog the way the player saves it
+	if (!catalog_load())
+	{
+		printf("CATALOG.BIN written by mkcard rejected\n");
+		errors++;
+		catalog_build();
+	}
+
+	// card bandwidth, also as a part of that of 16-bit stereo PCM at the rate
+	printf("%-12s %-16s %6s %8s %9s %8s %9s\n", "track", "format", "rate", "samples", "card KB/s", "of PCM", "ns/sample");
+
+	dirs = scan_dirs(-1, dirname);
+
+	for (d = 0 ; d <= dirs ; d++)
+	{
+		tracks = scan_tracks(d, -1, filename, dirname);
+
+		for (t = 1 ; t <= tracks ; t++)
+		{
+			scan_tracks(d, t, filename, dirname);
+
+			if (!(pcm = expected(argv[2], filename, &samples)))
+			{
+				printf("%s : no expected samples\n", filename);
+				errors++;
+				continue;
+			}
+
+			test_track(d, t, filename, pcm, samples, BUFSIZE >> 1, TRUE);
+			test_track(d, t, filename, pcm, samples, ODD_BLOCK, FALSE);
+
+			free(pcm);
+		}
+	}
+
+	// the benchmark frame of the 'f' command, decoded once by time_cycles() here
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	bench_flac(&decoder_ram.flac);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("\nbench_flac() frame of %u samples : %.1f us on this PC\n", FLAC_MAX_BLOCKSIZE,
+		(t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+
+	card_close();
+
+	if (errors)
+		printf("FAILED, %d errors\n", errors);
+
+	return errors != 0;
+}
@@ -0,0 +1,235 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  FSBENCH.C:  file system benchmark, FFs.c and mmc.c against the card emulator
+**
+**  Usage : fsbench [-a access] image
+**
+**  image is written by mkimage (the catalog is saved to it). -a is the card's
+**  access time in byte-times before each data token (default 100).
+**
+**  For each operation : calls, the READ_SINGLE_BLOCK and READ_MULTIPLE_BLOCK
+**  commands and blocks read and written by the card, the SPI time at the clock
+**  mmc.c sets, and the wall time on this PC. The data read is checked against
+**  the pattern mkimage wrote, and loading the saved catalog must read fewer
+**  blocks than building it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "card.h"
+#include "image.h"
+#include "ffs.h"
+#include "mmc.h"
+#include "types.h"
+
+#define REFILL	4		// sectors per read_sectors(), as main.c streams WAV tracks
+
+u32 spi_hz(void);
+
+static card_stats start;
+static struct timespec wall;
+static int errors;
+
+static void begin(void)
+{
+	start = card;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+}
+
+static void end(const char *op, u32 calls)
+{
+	struct timespec now;
+	u32 bytes = card.bytes - start.bytes;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	printf("%-20s %6u %6u %6u %7u %5u %9.1f %9.0f\n", op, calls,
+		card.commands[17] - start.commands[17], card.commands[18] - start.commands[18],
+		card.blocks_read - start.blocks_read, card.blocks_written - start.blocks_written,
+		bytes * 8000.0 / spi_hz(),
+		(now.tv_sec - wall.tv_sec) * 1e6 + (now.tv_nsec - wall.tv_nsec) / 1e3);
+}
+
+static bool mount(void)
+{
+	return hd_mbr() && hd_bpb();
+}
+
+// check data read at offset of the track with the index mkimage gave it
+static void check(u32 track, u32 offset, const u8 *p, u32 len)
+{
+	u32 i;
+
+	for (i = 0 ; i < len ; i++, offset++)
+		if (offset >= IMAGE_HEADER && p[i] != IMAGE_BYTE(track, offset))
+		{
+			printf("track %u : wrong data at offset %u\n", track, offset);
+			errors++;
+			return;
+		}
+}
+
+int main(int argc, char **argv)
+{
+	static u8 buffer[REFILL * 512];
+	card_config config = { CARD_SDHC, 100 };
+	char dirname[16], filename[16];
+	s16 dirs, tracks, d, t, n;
+	u32 calls, track, offset, bytes, spi_bytes, build_reads;
+	s8 fd;
+	int a;
+
+	for (a = 1 ; a < argc - 1 ; a++)
+	{
+		if (!strcmp(argv[a], "-a") && a + 1 < argc - 1)
+			config.access = atoi(argv[++a]);
+		else
+			break;
+	}
+
+	if (a != argc - 1)
+	{
+		fprintf(stderr, "usage: fsbench [-a access] image\n");
+		return 1;
+	}
+
+	if (!card_open(argv[a], &config) || !mmc_Initialise())
+	{
+		fprintf(stderr, "fsbench: no card\n");
+		return 1;
+	}
+
+	printf("\n%-20s %6s %6s %6s %7s %5s %9s %9s\n", "operation", "calls", "CMD17", "CMD18", "read", "write", "SPI ms", "wall us");
+
+	begin();
+	if (!mount()) { fprintf(stderr, "fsbench: no FAT volume\n"); return 1; }
+	end("mount", 1);
+
+	begin();
+	n = catalog_load();
+	end(n ? "catalog_load (hit)" : "catalog_load (miss)", 1);
+
+	begin();
+	n = catalog_build();
+	end("catalog_build", 1);
+	build_reads = card.blocks_read - start.blocks_read;
+
+	begin();
+	if (!catalog_save()) { printf("catalog_save failed\n"); errors++; }
+	end("catalog_save", 1);
+
+	mount();
+	begin();
+	if (!catalog_load()) { printf("saved catalog rejected\n"); errors++; }
+	end("catalog_load (hit)", 1);
+
+	if (card.blocks_read - start.blocks_read >= build_reads)
+	{
+		printf("catalog_load reads %u blocks, catalog_build %u\n", card.blocks_read - start.blocks_read, build_reads);
+		errors++;
+	}
+
+	begin();
+	dirs = scan_dirs(-1, dirname);
+	end("scan_dirs", 1);
+
+	begin();
+	for (d = 0 ; d <= dirs ; d++)
+		scan_tracks(d, -1, filename, dirname);
+	end("scan_tracks", dirs + 1);
+
+	// open by name searches the directory, open_track() uses the catalog
+	begin();
+	for (calls = 0, d = 0 ; d <= dirs ; d++)
+	{
+		tracks = scan_tracks(d, -1, filename, dirname);
+
+		for (t = 1 ; t <= tracks ; t++, calls++)
+		{
+			scan_tracks(d, t, filename, dirname);
+			if ((fd = open(filename, O_RDONLY, 0)) < 0) { printf("cannot open %s\n", filename); errors++; }
+			else close(fd);
+		}
+	}
+	end("open", calls);
+
+	begin();
+	for (calls = 0, d = 0 ; d <= dirs ; d++)
+	{
+		tracks = scan_tracks(d, -1, filename, dirname);
+
+		for (t = 1 ; t <= tracks ; t++, calls++)
+		{
+			if ((fd = open_track(d, t)) < 0) { printf("cannot open track %d of %d\n", t, d); errors++; }
+			else close(fd);
+		}
+	}
+	end("open_track", calls);
+
+	// seek to the last sector of every track, and check it
+	begin();
+	for (calls = 0, d = 0 ; d <= dirs ; d++)
+	{
+		tracks = scan_tracks(d, -1, filename, dirname);
+
+		for (t = 1 ; t <= tracks ; t++, calls++)
+		{
+			fd = open_track(d, t);
+			offset = (u32) lseek(fd, 0, SEEK_END);
+			offset = (offset - 1) & ~511;
+
+			lseek(fd, offset, SEEK_SET);
+
+			n = read_sectors(fd, buffer, 1, NULL);
+			track = (d ? d - 1 : 0) * tracks + t - 1;
+			check(track, offset, buffer, 512);
+			close(fd);
+		}
+	}
+	end("open, lseek, read", calls);
+
+	// read() in small pieces, one track
+	begin();
+	fd = open_track(dirs ? 1 : 0, 1);
+	for (calls = 0, offset = 0 ; (n = read(fd, buffer, 1000)) > 0 ; calls++, offset += n)
+		check(0, offset, buffer, n);
+	close(fd);
+	end("read (1000 bytes)", calls);
+
+	// stream every track in the refills the player uses
+	begin();
+	for (calls = 0, bytes = 0, d = 0 ; d <= dirs ; d++)
+	{
+		tracks = scan_tracks(d, -1, filename, dirname);
+
+		for (t = 1 ; t <= tracks ; t++)
+		{
+			track = (d ? d - 1 : 0) * tracks + t - 1;
+			fd = open_track(d, t);
+
+			for (offset = 0 ; (n = read_sectors(fd, buffer, REFILL, NULL)) > 0 ; calls++, offset += n << 9)
+				check(track, offset, buffer, n << 9);
+
+			bytes += offset;
+			close(fd);
+		}
+	}
+	spi_bytes = card.bytes - start.bytes;
+	end("read_sectors", calls);
+
+	printf("\nStreaming %u KB at %u KB/s of SPI time, %u SPI bytes per sector\n", bytes >> 10,
+		(u32) ((double) bytes / 1024 * spi_hz() / (spi_bytes * 8.0)), (u32) ((unsigned long long) spi_bytes * 512 / bytes));
+
+	card_close();
+
+	if (errors)
+		printf("%d errors\n", errors);
+
+	return errors != 0;
+}
@@ -0,0 +1,72 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  HOST.C:  host stand-ins for the peripherals and serial routines used by mmc.c
+**  and FFs.c, so they run unchanged against the card emulator
+*/
+
+#include <stdio.h>
+#include "LPC213x.H"
+#include "card.h"
+#include "types.h"
+
+volatile unsigned long IOCLR0, IOSET0, IODIR0, PINSEL0;
+volatile unsigned long S0SPCR, S0SPCCR, S0SPDR;
+
+// the byte written to S0SPDR is exchanged with the card when the status is read
+unsigned long spi_status(void)
+{
+	S0SPDR = card_xfer((u8) S0SPDR);
+
+	return 128;		// SPIF
+}
+
+// SPI clock rate set in S0SPCCR, with the LPC2138 PCLK of 15MHz
+u32 spi_hz(void)
+{
+	return S0SPCCR ? 15000000 / S0SPCCR : 0;
+}
+
+// serial port : output to stdout, no key is ever pressed
+int putchar(int ch)
+{
+	return fputc(ch, stdout);
+}
+
+int host_puts(const char *s)	// puts() of the target, without the newline
+{
+	return fputs(s, stdout);
+}
+
+int getchar(void)
+{
+	return -1;
+}
+
+int kbhit(void)
+{
+	return 0;
+}
+
+char *itoa(int n,int bits)
+{
+	static char buf[12];
+
+	(void) bits;
+	snprintf(buf, sizeof(buf), "%d", n);
+
+	return buf;
+}
+
+void delay_100ms(void)
+{
+}
+
+u32 time_cycles(void (*fn)(void))
+{
+	fn();
+
+	return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  Contents of the tracks written by mkimage, so tests can check what they read
+*/
+
+// Tracks are numbered across the card from 0, in directory order, then play order.
+// Each holds a 44 byte WAV header (44.1kHz 16-bit stereo) followed by IMAGE_BYTE()
+#define IMAGE_HEADER	44
+
+#define IMAGE_BYTE(track,offset)	((u8) ((offset) ^ ((offset) >> 9) * 7 ^ (track) * 37))
+
+#endif
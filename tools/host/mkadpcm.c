@@ -0,0 +1,261 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  MKADPCM.C:  PC tool writing IMA ADPCM test streams for the host tests
+**
+**  Usage : mkadpcm music_dir expected_dir
+**
+**  Writes IMA ADPCM WAV files (format 0x11) of each channel count and of block
+**  sizes read with read_sectors() and with read() into music_dir, to be put on a
+**  card by mkcard. For each, expected_dir/<name>.PCM gets the samples the player
+**  must output : 16-bit stereo, little endian, mono on both channels.
+**
+**  The expected samples are decoded from the blocks written by a reference decoder
+**  following the IMA ADPCM recommendation, not by src/adpcm.c. The signal has
+**  noise, full scale steps driving the predictor into its clamps, a fast tone
+**  driving the step index to the top and silence driving it to the bottom, over
+**  and over. Every file ends with a short block.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../src/types.h"
+
+#define MAX_BLOCK		2048	// ADPCM_MAX_BLOCK of the player
+
+typedef struct
+{
+	const char *name;
+	u16 channels;
+	u16 align;			// block size in bytes
+	u32 rate;
+	u32 samples;		// samples of the signal, the last block is padded
+} stream;
+
+static const stream streams[] =
+{
+	{ "A1024S",	2, 1024, 22050, 50000 },
+	{ "B512M",	1, 512,  22050, 40000 },
+	{ "C264S",	2, 264,  22050, 30001 },
+	{ "D2048S",	2, 2048, 44100, 44100 },
+	{ "E36M",	1, 36,   8000,  10000 },
+};
+
+typedef struct
+{
+	s32 sample;
+	s32 index;
+} state;
+
+static const u16 step_table[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const s8 index_table[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static u32 seed = 1;
+
+static void fail(const char *msg, const char *name)
+{
+	fprintf(stderr, "mkadpcm: %s %s\n", msg, name);
+	exit(1);
+}
+
+static void put16(u8 *p, u32 v) { p[0] = (u8) v; p[1] = (u8) (v >> 8); }
+static void put32(u8 *p, u32 v) { put16(p, v); put16(p + 2, v >> 16); }
+
+// -range..range, the same on every host
+static s32 noise(s32 range)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return (s32) ((seed >> 16) % (2 * range + 1)) - range;
+}
+
+// the events repeat every 8192 samples
+static s16 signal(u32 i, u16 c)
+{
+	u32 k = i & 8191;
+	s32 s;
+
+	if (k >= 500 && k < 520)
+		return k & 1 ? 32767 : -32768;
+	if (k >= 1500 && k < 1700)
+		return 0;
+	if (k >= 2000 && k < 2100)
+		return (s16) (30000 * sin(i * 2.9));
+
+	s = (s32) (12000 * sin(i * (0.03 + 0.05 * c))) + noise(3000);
+
+	return (s16) s;
+}
+
+// reference decoder : the next sample from a 4-bit code
+static s16 decode(state *st, u8 code)
+{
+	s32 step = step_table[st -> index], diff = step >> 3;
+
+	if (code & 4) diff += step;
+	if (code & 2) diff += step >> 1;
+	if (code & 1) diff += step >> 2;
+
+	st -> sample += code & 8 ? -diff : diff;
+
+	if (st -> sample > 32767) st -> sample = 32767;
+	if (st -> sample < -32768) st -> sample = -32768;
+
+	st -> index += index_table[code & 7];
+
+	if (st -> index < 0) st -> index = 0;
+	if (st -> index > 88) st -> index = 88;
+
+	return (s16) st -> sample;
+}
+
+// the code of the next sample
+static u8 encode(const state *st, s32 x)
+{
+	s32 step = step_table[st -> index], diff = x - st -> sample;
+	u8 code = 0;
+
+	if (diff < 0) { code = 8; diff = -diff; }
+
+	if (diff >= step) { code |= 4; diff -= step; }
+	step >>= 1;
+	if (diff >= step) { code |= 2; diff -= step; }
+	step >>= 1;
+	if (diff >= step) code |= 1;
+
+	return code;
+}
+
+// Decode a block of bytes into out as stereo samples, the reference way : a header
+// per channel, then 4 bytes of 8 codes per channel in turn, low nibble first
+static u32 decode_block(const u8 *block, u32 bytes, u16 channels, s16 *out)
+{
+	state st[2];
+	u32 samples = 1 + (bytes - 4 * channels) / (4 * channels) * 8, i;
+	u16 c;
+	u8 b;
+
+	for (c = 0 ; c < channels ; c++)
+	{
+		st[c].sample = (s16) (block[4 * c] | block[4 * c + 1] << 8);
+		st[c].index = block[4 * c + 2] > 88 ? 88 : block[4 * c + 2];
+		out[c] = (s16) st[c].sample;
+	}
+
+	for (i = 1 ; i < samples ; i++)
+		for (c = 0 ; c < channels ; c++)
+		{
+			b = block[4 * channels + (i - 1) / 8 * 4 * channels + 4 * c + (i - 1) % 8 / 2];
+			out[2 * i + c] = decode(&st[c], (i - 1) & 1 ? b >> 4 : b & 15);
+		}
+
+	if (channels == 1)
+		for (i = 0 ; i < samples ; i++)
+			out[2 * i + 1] = out[2 * i];
+
+	return samples;
+}
+
+static void make(const stream *s, const char *music, const char *expected)
+{
+	static u8 block[MAX_BLOCK];
+	static s16 out[2 * MAX_BLOCK * 2];
+	u32 per_block = 1 + (s -> align - 4 * s -> channels) / (4 * s -> channels) * 8;
+	u32 i, j, n, bytes, data = 0, total = 0;
+	u8 header[60], *b;
+	char path[512];
+	state st[2] = { { 0, 0 }, { 0, 0 } };
+	FILE *wav, *pcm;
+	u16 c;
+
+	snprintf(path, sizeof(path), "%s/%s.WAV", music, s -> name);
+	if (!(wav = fopen(path, "wb"))) fail("cannot create", path);
+	snprintf(path, sizeof(path), "%s/%s.PCM", expected, s -> name);
+	if (!(pcm = fopen(path, "wb"))) fail("cannot create", path);
+
+	fseek(wav, sizeof(header), SEEK_SET);
+	seed = 1;
+
+	for (i = 0 ; i < s -> samples ; i += n)
+	{
+		n = s -> samples - i < per_block ? s -> samples - i : per_block;
+
+		// whole runs of 8 codes, the padding is left 0
+		bytes = 4 * s -> channels * (1 + (n + 6) / 8);
+		memset(block, 0, bytes);
+
+		for (c = 0 ; c < s -> channels ; c++)
+		{
+			// the 1st sample is stored as is, the step index carries on
+			st[c].sample = signal(i, c);
+			put16(block + 4 * c, (u16) st[c].sample);
+			block[4 * c + 2] = (u8) st[c].index;
+
+			for (j = 1 ; j < n ; j++)
+			{
+				u8 code = encode(&st[c], signal(i + j, c));
+
+				b = block + 4 * s -> channels + (j - 1) / 8 * 4 * s -> channels + 4 * c + (j - 1) % 8 / 2;
+				*b |= (j - 1) & 1 ? code << 4 : code;
+				decode(&st[c], code);
+			}
+		}
+
+		if (fwrite(block, 1, bytes, wav) != bytes) fail("cannot write", s -> name);
+		data += bytes;
+
+		j = decode_block(block, bytes, s -> channels, out);
+		if (fwrite(out, 4, j, pcm) != j) fail("cannot write", path);
+		total += j;
+	}
+
+	// RIFF header, fmt with the samples per block, fact
+	memset(header, 0, sizeof(header));
+	memcpy(header, "RIFF", 4);			put32(header + 4, sizeof(header) - 8 + data);
+	memcpy(header + 8, "WAVEfmt ", 8);	put32(header + 16, 20);
+	put16(header + 20, 0x11);			put16(header + 22, s -> channels);
+	put32(header + 24, s -> rate);		put32(header + 28, s -> rate * s -> align / per_block);
+	put16(header + 32, s -> align);		put16(header + 34, 4);
+	put16(header + 36, 2);				put16(header + 38, per_block);
+	memcpy(header + 40, "fact", 4);		put32(header + 44, 4);
+	put32(header + 48, s -> samples);
+	memcpy(header + 52, "data", 4);		put32(header + 56, data);
+
+	fseek(wav, 0, SEEK_SET);
+	if (fwrite(header, 1, sizeof(header), wav) != sizeof(header)) fail("cannot write", s -> name);
+
+	fclose(wav);
+	fclose(pcm);
+
+	printf("%s.WAV : %u channels, %u byte blocks, %u samples, %u bytes of data\n", s -> name, s -> channels, s -> align, total, data);
+}
+
+int main(int argc, char **argv)
+{
+	u32 i;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: mkadpcm music_dir expected_dir\n");
+		return 1;
+	}
+
+	for (i = 0 ; i < sizeof(streams) / sizeof(streams[0]) ; i++)
+		make(&streams[i], argv[1], argv[2]);
+
+	return 0;
+}
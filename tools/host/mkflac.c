@@ -0,0 +1,588 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  MKFLAC.C:  PC tool writing FLAC test streams for the host tests
+**
+**  Usage : mkflac music_dir expected_dir
+**
+**  Writes FLAC files of 8, 16 and 24-bit samples, mono and stereo, into music_dir,
+**  to be put on a card by mkcard. For each, expected_dir/<name>.PCM gets the
+**  samples the player must output : 16-bit stereo, little endian, mono on both
+**  channels, scaled to 16 bits by shifting.
+**
+**  FLAC is lossless, so the expected samples are the signal encoded. The encoder
+**  picks at random, frame by frame : block sizes of every header code (up to the
+**  1152 samples of FLAC_MAX_BLOCKSIZE), each way of coding the sample rate and
+**  size, every stereo decorrelation, constant, verbatim, fixed and LPC subframes
+**  of orders up to 32, wasted bits, Rice and Rice2 residuals in partitions, and
+**  escaped partitions. Metadata blocks run over sectors, and a file can end with
+**  an ID3v1 tag. The signal has noise, silence, full scale squares, and runs of
+**  samples with low bits clear. One stream is coded plainly instead (mid-side,
+**  fixed order 2, Rice parameter from the mean), for a realistic card bandwidth.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../src/types.h"
+
+#define MAX_SAMPLES		20000
+#define MAX_BLOCKSIZE	1152	// FLAC_MAX_BLOCKSIZE of the player
+#define MAX_ORDER		32
+#define FRAME_BYTES		(1 << 20)
+
+typedef struct
+{
+	const char *name;
+	u8 channels;
+	u8 bps;				// bits per sample
+	u32 rate;
+	u32 samples;
+	u32 seed;
+	u8 fixed_code;		// block size code of every frame, 0 for any
+	bool metadata;		// blocks other than STREAMINFO
+	bool tag;			// ID3v1 tag at the end
+	bool plain;			// coded as a plain encoder would, not at random
+} stream;
+
+static const stream streams[] =
+{
+	{ "A16S",	2, 16, 44100, 12000, 11, 0, TRUE,  TRUE,  FALSE },
+	{ "B16M",	1, 16, 22050, 9000,  12, 0, TRUE,  FALSE, FALSE },
+	{ "C24S",	2, 24, 48000, 7000,  13, 0, FALSE, FALSE, FALSE },
+	{ "D8S",	2, 8,  11025, 6000,  14, 0, TRUE,  FALSE, FALSE },
+	{ "E16S",	2, 16, 44100, 20000, 15, 3, TRUE,  FALSE, FALSE },
+	{ "F16S",	2, 16, 44100, 20000, 16, 3, TRUE,  FALSE, TRUE  },
+};
+
+// block size codes and sizes picked from, 6 and 7 are sizes given in the header
+static const u16 sizes[][2] =
+{
+	{ 1, 192 }, { 2, 576 }, { 3, 1152 }, { 8, 256 }, { 9, 512 }, { 10, 1024 },
+	{ 6, 100 }, { 7, 1000 }, { 7, 777 }
+};
+
+static const u8 size_codes[25] = { [8] = 1, [12] = 2, [16] = 4, [20] = 5, [24] = 6 };
+
+// bits written MSB first
+typedef struct
+{
+	u8 *buf;
+	u32 bytes;
+	u32 acc;
+	u32 n;
+} bitwriter;
+
+static s32 signal[2][MAX_SAMPLES];
+static u32 seed;
+static bool plain;		// of the stream being written
+
+static void fail(const char *msg, const char *name)
+{
+	fprintf(stderr, "mkflac: %s %s\n", msg, name);
+	exit(1);
+}
+
+// pseudo random numbers, the same on every host
+static u32 rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return seed >> 8;
+}
+
+static s32 randint(s32 lo, s32 hi)
+{
+	return lo + (s32) (rnd() % (u32) (hi - lo + 1));
+}
+
+static double uniform(void)
+{
+	return rnd() / 16777216.0;
+}
+
+static void put_bits(bitwriter *w, u32 v, u32 n)
+{
+	while (n--)
+	{
+		w -> acc = (w -> acc << 1) | ((v >> n) & 1);
+
+		if (++w -> n == 8)
+		{
+			w -> buf[w -> bytes++] = (u8) w -> acc;
+			w -> acc = w -> n = 0;
+		}
+	}
+}
+
+static void put_unary(bitwriter *w, u32 q)
+{
+	while (q--)
+		put_bits(w, 0, 1);
+
+	put_bits(w, 1, 1);
+}
+
+static void put_align(bitwriter *w)
+{
+	while (w -> n)
+		put_bits(w, 0, 1);
+}
+
+static u8 crc8(const u8 *p, u32 n)
+{
+	u8 crc = 0, i;
+
+	while (n--)
+		for (crc ^= *p++, i = 0 ; i < 8 ; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+
+	return crc;
+}
+
+static u16 crc16(const u8 *p, u32 n)
+{
+	u16 crc = 0, i;
+
+	while (n--)
+		for (crc ^= *p++ << 8, i = 0 ; i < 8 ; i++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+
+	return crc;
+}
+
+// sample number, UTF-8 coded
+static void put_utf8(bitwriter *w, u32 v)
+{
+	u32 n, i;
+
+	if (v < 0x80)
+	{
+		put_bits(w, v, 8);
+		return;
+	}
+
+	for (n = 2 ; n < 7 && v >= 1u << (5 * n + 1) ; n++)
+		;
+
+	put_bits(w, ((0xFF << (8 - n)) & 0xFF) | (v >> (6 * (n - 1))), 8);
+
+	for (i = n - 1 ; i-- ; )
+		put_bits(w, 0x80 | ((v >> (6 * i)) & 63), 8);
+}
+
+// bits of a signed value
+static u32 bits_needed(long long v)
+{
+	u32 n = 1;
+
+	while (v < -(1LL << (n - 1)) || v >= 1LL << (n - 1))
+		n++;
+
+	return n;
+}
+
+// residuals of a subframe of bs samples, order warm up samples
+static void residual(bitwriter *w, const s32 *r, u32 order, u32 bs)
+{
+	u32 method = plain ? 0 : rnd() & 1, max_po = 0, po, ps, esc, p, cnt, i, k, nb;
+	long long big, sum;
+	double mean;
+
+	while (((bs >> (max_po + 1)) << (max_po + 1)) == bs && bs >> (max_po + 1) >= order && max_po < 8)
+		max_po++;
+
+	po = plain ? 0 : randint(0, max_po);
+	ps = bs >> po;
+	esc = method ? 31 : 15;
+
+	put_bits(w, method, 2);
+	put_bits(w, po, 4);
+
+	for (p = 0 ; p < 1u << po ; p++)
+	{
+		cnt = ps - (p ? 0 : order);
+
+		for (sum = big = 0, i = 0 ; i < cnt ; i++)
+		{
+			sum += llabs(r[i]);
+			big = llabs(r[i]) > big ? llabs(r[i]) : big;
+		}
+
+		mean = (double) sum / (cnt ? cnt : 1);
+		k = mean >= 1 ? (u32) log2(mean) : 0;
+		k = k < esc - 1 ? k : esc - 1;
+
+		if ((!plain && uniform() < 0.05) || (big * 2) >> k > 2000)
+		{
+			// escaped : verbatim residuals of nb bits
+			for (nb = 0, i = 0 ; i < cnt ; i++)
+				if (r[i])
+					nb = bits_needed(r[i]) > nb ? bits_needed(r[i]) : nb;
+
+			if (nb > 31)
+				fail("residual too large", "");
+			if (nb == 1)
+				nb = 2;
+
+			put_bits(w, esc, method ? 5 : 4);
+			put_bits(w, nb, 5);
+
+			for (i = 0 ; nb && i < cnt ; i++)
+				put_bits(w, (u32) r[i], nb);
+		}
+		else
+		{
+			put_bits(w, k, method ? 5 : 4);
+
+			for (i = 0 ; i < cnt ; i++)
+			{
+				unsigned long long u = r[i] >= 0 ? 2ULL * r[i] : 2ULL * -(long long) r[i] - 1;
+
+				put_unary(w, (u32) (u >> k));
+				put_bits(w, (u32) u, k);
+			}
+		}
+
+		r += cnt;
+	}
+}
+
+// a subframe of bs samples of sbps bits
+static void subframe(bitwriter *w, const s32 *x, u32 bs, u32 sbps)
+{
+	static s32 y[MAX_BLOCKSIZE], r[MAX_BLOCKSIZE];
+	u32 wasted = 0, sb, i, j, o = 0, prec, type, kind, nonzero = 0, same = 1;
+	s32 c[MAX_ORDER], shift, lim, base, S;
+	long long s;
+
+	for (i = 0 ; i < bs ; i++)
+	{
+		nonzero |= x[i];
+		same &= x[i] == x[0];
+	}
+
+	// wasted bits : low bits clear in every sample, or some of them
+	if (nonzero)
+		while (!((nonzero >> wasted) & 1))
+			wasted++;
+
+	if (!plain && uniform() < 0.5)
+		wasted = randint(0, wasted);
+
+	for (i = 0 ; i < bs ; i++)
+		y[i] = x[i] >> wasted;
+
+	sb = sbps - wasted;
+
+	// constant, verbatim, fixed or LPC
+	kind = same && (plain || uniform() < 0.8) ? 'c' : plain ? 'f' : "vfflll"[rnd() % 6];
+
+	if (kind == 'c')
+		type = 0;
+	else if (kind == 'v')
+		type = 1;
+	else if (kind == 'f')
+		type = 8 + (o = plain ? (bs < 2 ? bs : 2) : (u32) randint(0, bs < 4 ? bs : 4));
+	else
+		type = 32 + (o = uniform() < 0.3 ? randint(1, bs < 32 ? bs : 32) : randint(1, bs < 12 ? bs : 12)) - 1;
+
+	put_bits(w, 0, 1);
+	put_bits(w, type, 6);
+
+	if (wasted)
+	{
+		put_bits(w, 1, 1);
+		put_unary(w, wasted - 1);
+	}
+	else
+		put_bits(w, 0, 1);
+
+	if (kind == 'c')
+	{
+		put_bits(w, (u32) y[0], sb);
+		return;
+	}
+
+	if (kind == 'v')
+	{
+		for (i = 0 ; i < bs ; i++)
+			put_bits(w, (u32) y[i], sb);
+		return;
+	}
+
+	for (i = 0 ; i < o ; i++)
+		put_bits(w, (u32) y[i], sb);
+
+	if (kind == 'f')
+	{
+		for (i = o ; i < bs ; i++)
+			r[i - o] = y[i] - (o == 0 ? 0 : o == 1 ? y[i - 1] : o == 2 ? 2 * y[i - 1] - y[i - 2] :
+				o == 3 ? 3 * y[i - 1] - 3 * y[i - 2] + y[i - 3] : 4 * y[i - 1] - 6 * y[i - 2] + 4 * y[i - 3] - y[i - 4]);
+
+		residual(w, r, o, bs);
+		return;
+	}
+
+	// LPC : coefficients extrapolating the last 2 samples, with noise
+	prec = randint(1, 15);
+	shift = randint(0, 15);
+	lim = 1 << (prec - 1);
+	base = 1 << (shift < (s32) prec - 2 ? shift : prec >= 2 ? (s32) prec - 2 : 0);
+
+	for (S = 0, j = 0 ; j < o ; j++)
+	{
+		c[j] = j == 0 ? 2 * base : j == 1 ? -base : 0;
+		c[j] += randint(-lim, lim - 1) / (1 << 2 * (rnd() & 3));
+		c[j] = c[j] < -lim ? -lim : c[j] > lim - 1 ? lim - 1 : c[j];
+		S += abs(c[j]);
+	}
+
+	// keep the predictions well within 32 bits
+	while (shift < 15 && ((long long) S << (sb - 1)) >> shift >= 1 << 29)
+		shift++;
+
+	if (((long long) S << (sb - 1)) >> shift >= 1 << 29)
+		for (j = 0 ; j < o ; j++)
+			c[j] = c[j] < -1 ? -1 : c[j] > 1 ? 1 : c[j];
+
+	put_bits(w, prec - 1, 4);
+	put_bits(w, (u32) shift, 5);
+
+	for (j = 0 ; j < o ; j++)
+		put_bits(w, (u32) c[j], prec);
+
+	for (i = o ; i < bs ; i++)
+	{
+		for (s = 0, j = 0 ; j < o ; j++)
+			s += (long long) c[j] * y[i - 1 - j];
+
+		r[i - o] = (s32) (u32) (y[i] - (s >> shift));
+	}
+
+	residual(w, r, o, bs);
+}
+
+// the test signal of a channel, full scale for bps bits
+static void make_signal(const stream *st)
+{
+	s32 top = (1 << (st -> bps - 1)) - 1, v;
+	double s;
+	u32 c, i;
+
+	for (c = 0 ; c < st -> channels ; c++)
+		for (i = 0 ; i < st -> samples ; i++)
+		{
+			s = 0.6 * sin(i * 0.01 * (c + 1)) + 0.3 * sin(i * 0.13 + c) + (uniform() - 0.5) * 0.04;
+
+			if (i >= 3000 && i < 3400)
+				s = 0;
+			if (i >= 5000 && i < 5200)
+				s = (i / 7) & 1 ? 1 : -1;
+
+			v = (s32) (s * top);
+			v = v < -top - 1 ? -top - 1 : v > top ? top : v;
+
+			// low bits clear in one channel, then in both
+			if (c == 1 && i >= 6000 && i < 6600)
+				v &= ~3;
+			if (i >= 7000 && i < 8200)
+				v &= ~15;
+
+			signal[c][i] = v;
+		}
+}
+
+static void make(const stream *st, const char *music, const char *expected)
+{
+	static u8 buf[FRAME_BYTES];
+	static s32 side[MAX_BLOCKSIZE], mid[MAX_BLOCKSIZE];
+	bitwriter w;
+	u32 i, j, code, bs, asg, rc, min_bs = 65535, max_bs = 0, meta, data = 0;
+	const s32 *l = signal[0], *r = signal[st -> channels - 1];
+	char path[512];
+	u8 header[4 + 38 + 4 + 14 + 4 + 3000 + 4 + 700], *h;
+	FILE *flac, *pcm;
+	s16 out[2];
+
+	seed = st -> seed;
+	plain = st -> plain;
+	make_signal(st);
+
+	snprintf(path, sizeof(path), "%s/%s.FLAC", music, st -> name);
+	if (!(flac = fopen(path, "wb"))) fail("cannot create", path);
+
+	meta = st -> metadata ? sizeof(header) : 4 + 38;
+	fseek(flac, meta, SEEK_SET);
+
+	for (i = 0 ; i < st -> samples ; i += bs)
+	{
+		j = st -> fixed_code ? 2 : rnd() % (sizeof(sizes) / sizeof(sizes[0]));
+		code = sizes[j][0];
+		bs = sizes[j][1];
+
+		// a short last frame has its size in the header
+		if (bs > st -> samples - i)
+		{
+			bs = st -> samples - i;
+			code = bs > 256 ? 7 : 6;
+		}
+
+		min_bs = bs < min_bs ? bs : min_bs;
+		max_bs = bs > max_bs ? bs : max_bs;
+
+		asg = st -> channels == 1 ? 0 : plain ? 10 : "\x01\x08\x09\x0A"[rnd() & 3];
+		rc = plain ? 0 : "\x00\x00\x0C\x0D\x0E"[rnd() % 5];
+
+		// header : sync code of variable block sizes, then the 1st sample number
+		memset(&w, 0, sizeof(w));
+		w.buf = buf;
+
+		put_bits(&w, 0xFFF9, 16);
+		put_bits(&w, code, 4);
+		put_bits(&w, rc, 4);
+		put_bits(&w, asg, 4);
+		put_bits(&w, plain || rnd() & 1 ? size_codes[st -> bps] : 0, 3);
+		put_bits(&w, 0, 1);
+		put_utf8(&w, i);
+
+		if (code == 6)
+			put_bits(&w, bs - 1, 8);
+		if (code == 7)
+			put_bits(&w, bs - 1, 16);
+
+		if (rc == 12)
+			put_bits(&w, st -> rate / 1000, 8);
+		if (rc == 13)
+			put_bits(&w, st -> rate, 16);
+		if (rc == 14)
+			put_bits(&w, st -> rate / 10, 16);
+
+		put_bits(&w, crc8(buf, w.bytes), 8);
+
+		// subframes, the side channel has an extra bit
+		for (j = 0 ; j < bs ; j++)
+		{
+			side[j] = l[i + j] - r[i + j];
+			mid[j] = (l[i + j] + r[i + j]) >> 1;
+		}
+
+		if (asg == 8)
+		{
+			subframe(&w, l + i, bs, st -> bps);
+			subframe(&w, side, bs, st -> bps + 1);
+		}
+		else if (asg == 9)
+		{
+			subframe(&w, side, bs, st -> bps + 1);
+			subframe(&w, r + i, bs, st -> bps);
+		}
+		else if (asg == 10)
+		{
+			subframe(&w, mid, bs, st -> bps);
+			subframe(&w, side, bs, st -> bps + 1);
+		}
+		else
+			for (j = 0 ; j < st -> channels ; j++)
+				subframe(&w, signal[j] + i, bs, st -> bps);
+
+		put_align(&w);
+		put_bits(&w, crc16(buf, w.bytes), 16);
+
+		if (fwrite(buf, 1, w.bytes, flac) != w.bytes) fail("cannot write", path);
+		data += w.bytes;
+	}
+
+	if (st -> tag)
+	{
+		memset(buf, 0, 128);
+		memcpy(buf, "TAG", 3);
+		if (fwrite(buf, 1, 128, flac) != 128) fail("cannot write", path);
+	}
+
+	// marker, STREAMINFO (no frame sizes or MD5), then a VORBIS_COMMENT with no
+	// comments, an APPLICATION block and PADDING
+	memset(header, 0, sizeof(header));
+	memcpy(header, "fLaC", 4);
+
+	memset(&w, 0, sizeof(w));
+	w.buf = header + 4;
+
+	put_bits(&w, st -> metadata ? 0 : 0x80, 8);
+	put_bits(&w, 34, 24);
+	put_bits(&w, min_bs, 16);
+	put_bits(&w, max_bs, 16);
+	put_bits(&w, 0, 24);
+	put_bits(&w, 0, 24);
+	put_bits(&w, st -> rate, 20);
+	put_bits(&w, st -> channels - 1, 3);
+	put_bits(&w, st -> bps - 1, 5);
+	put_bits(&w, 0, 4);
+	put_bits(&w, st -> samples, 32);
+
+	h = header + 4 + 38;
+
+	if (st -> metadata)
+	{
+		h[0] = 4;
+		h[3] = 14;
+		memcpy(h + 4, "\x06\0\0\0mkflac\0\0\0\0", 14);
+		h += 4 + 14;
+
+		h[0] = 2;
+		h[2] = 3000 >> 8;
+		h[3] = 3000 & 0xFF;
+		for (j = 0 ; j < 3000 ; j++)
+			h[4 + j] = (u8) rnd();
+		h += 4 + 3000;
+
+		h[0] = 0x81;
+		h[2] = 700 >> 8;
+		h[3] = 700 & 0xFF;
+	}
+
+	fseek(flac, 0, SEEK_SET);
+	if (fwrite(header, 1, meta, flac) != meta) fail("cannot write", path);
+	fclose(flac);
+
+	// expected samples
+	snprintf(path, sizeof(path), "%s/%s.PCM", expected, st -> name);
+	if (!(pcm = fopen(path, "wb"))) fail("cannot create", path);
+
+	for (i = 0 ; i < st -> samples ; i++)
+	{
+		for (j = 0 ; j < 2 ; j++)
+		{
+			s32 v = j ? r[i] : l[i];
+
+			out[j] = (s16) (st -> bps >= 16 ? v >> (st -> bps - 16) : v << (16 - st -> bps));
+		}
+
+		if (fwrite(out, 4, 1, pcm) != 1) fail("cannot write", path);
+	}
+
+	fclose(pcm);
+
+	printf("%s.FLAC : %u channels, %u bits, %u samples, %u bytes of frames, %u of PCM\n", st -> name,
+		st -> channels, st -> bps, st -> samples, data, st -> samples * st -> channels * st -> bps / 8);
+}
+
+int main(int argc, char **argv)
+{
+	u32 i;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: mkflac music_dir expected_dir\n");
+		return 1;
+	}
+
+	for (i = 0 ; i < sizeof(streams) / sizeof(streams[0]) ; i++)
+		make(&streams[i], argv[1], argv[2]);
+
+	return 0;
+}
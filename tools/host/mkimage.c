@@ -0,0 +1,340 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  MKIMAGE.C:  PC tool writing synthetic FAT16 card images for the host tests
+**
+**  Unlike mkcard, the layout is chosen to exercise the file system : tracks can
+**  be fragmented, names can have long name entries, and no catalog is written.
+**
+**  Usage : mkimage [-c sectors] [-d dirs] [-t tracks] [-k track_kb] [-f clusters] [-l] image
+**
+**  -c  sectors per cluster, a power of 2 up to 64 (default 8)
+**  -d  subdirectories of the root, each holding the tracks (default 0, tracks in the root)
+**  -t  tracks per directory (default 16)
+**  -k  size of each track in KB (default 256)
+**  -f  fragment length in clusters : the clusters of all the tracks are handed out
+**      round robin in runs of this length (default 0, every track contiguous)
+**  -l  give every directory and track a long name, 3 extra entries each
+**
+**  Track contents are described in image.h. The image is sized for the FAT16
+**  cluster count range and left sparse where nothing is written.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/types.h"
+#include "image.h"
+
+#define BLOCKSIZE		512
+
+#define PART_START		32		// partition 1st sector
+#define ROOT_ENTRIES	512		// root directory entries
+#define LFN_ENTRIES		3		// long name entries per name, 39 characters
+
+#define ATTR_DIRECTORY	0x10
+#define ATTR_ARCHIVE	0x20
+#define ATTR_LONG_NAME	0x0F
+
+static u32 spc = 8, dirs, tracks = 16, track_kb = 256, fragment;
+static int lfn;
+
+static u32 clusters, fatsz, lba_fat, lba_rd, lba_data, next_clust = 2;
+static u16 *fat;
+static FILE *img;
+
+static void fail(const char *msg)
+{
+	fprintf(stderr, "mkimage: %s\n", msg);
+	exit(1);
+}
+
+static void put16(u8 *p, u32 v) { p[0] = (u8) v; p[1] = (u8) (v >> 8); }
+static void put32(u8 *p, u32 v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static void write_at(u32 lba, const void *buf, u32 len)
+{
+	if (fseeko(img, (off_t) lba * BLOCKSIZE, SEEK_SET) || fwrite(buf, 1, len, img) != len)
+		fail("write error");
+}
+
+static u32 clust2lba(u32 clust)
+{
+	return lba_data + (clust - 2) * spc;
+}
+
+static u32 clust_count(u32 bytes)
+{
+	return (bytes + spc * BLOCKSIZE - 1) / (spc * BLOCKSIZE);
+}
+
+static u32 entries(u32 names)	// directory entries for names
+{
+	return names * (lfn ? LFN_ENTRIES + 1 : 1);
+}
+
+// Append the entries of a name to a directory at *p : long name entries if -l, then
+// the 8.3 entry
+static u8 *dirent_put(u8 *p, const char *name, const char *longname, u8 attr, u32 clust, u32 size)
+{
+	u8 sum = 0;
+	int i, j, k, c;
+
+	for (i = 0 ; i < 11 ; i++)
+		sum = (u8) (((sum & 1) << 7) + (sum >> 1) + (u8) name[i]);
+
+	for (i = lfn ? LFN_ENTRIES : 0 ; i > 0 ; i--, p += 32)
+	{
+		static const u8 at[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+		memset(p, 0, 32);
+		p[0] = (u8) (i | (i == LFN_ENTRIES ? 0x40 : 0));
+		p[11] = ATTR_LONG_NAME;
+		p[13] = sum;
+
+		for (j = 0 ; j < 13 ; j++)
+		{
+			k = (i - 1) * 13 + j;
+			c = k < (int) strlen(longname) ? (u8) longname[k] : (k == (int) strlen(longname) ? 0 : 0xFFFF);
+			put16(p + at[j], c);
+		}
+	}
+
+	memset(p, 0, 32);
+	memcpy(p, name, 11);
+	p[11] = attr;
+	put16(p + 20, clust >> 16);
+	put16(p + 26, clust);
+	put32(p + 28, size);
+
+	return p + 32;
+}
+
+static u32 alloc(u32 count)	// Allocate a run of count clusters, return its 1st cluster
+{
+	u32 start = next_clust;
+
+	if (next_clust + count > clusters + 2) fail("out of clusters");
+
+	next_clust += count;
+
+	return start;
+}
+
+static void chain(u32 *last, u32 start, u32 count)	// link a run to the chain ending at *last
+{
+	u32 i;
+
+	if (*last) fat[*last] = (u16) start;
+
+	for (i = start ; i < start + count - 1 ; i++)
+		fat[i] = (u16) (i + 1);
+
+	fat[i] = 0xFFFF;
+	*last = i;
+}
+
+int main(int argc, char **argv)
+{
+	u32 track_size, track_clusters, dir_clusters, need, part, reserved = 1, rd_sectors = ROOT_ENTRIES * 32 / BLOCKSIZE;
+	u32 names, n, d, t, i, j, lba, o, left, total;
+	u32 *first, *last, *done, *dir_clust;
+	u8 sec[BLOCKSIZE], *root, *dir, *p, *buf;
+	char name[20], longname[64];
+	int a;
+
+	for (a = 1 ; a < argc - 1 ; a++)
+	{
+		if (!strcmp(argv[a], "-c") && a + 1 < argc - 1)
+			spc = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-d") && a + 1 < argc - 1)
+			dirs = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-t") && a + 1 < argc - 1)
+			tracks = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-k") && a + 1 < argc - 1)
+			track_kb = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-f") && a + 1 < argc - 1)
+			fragment = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-l"))
+			lfn = 1;
+		else
+			break;
+	}
+
+	if (a != argc - 1)
+	{
+		fprintf(stderr, "usage: mkimage [-c sectors] [-d dirs] [-t tracks] [-k track_kb] [-f clusters] [-l] image\n");
+		return 1;
+	}
+
+	if (!spc || spc & (spc - 1) || spc > 64) fail("sectors per cluster must be a power of 2 up to 64");
+	if (!track_kb) fail("tracks must not be empty");
+	if (dirs > 999 || tracks > 99999) fail("too many directories or tracks");
+
+	names = dirs ? dirs : tracks;
+	if (entries(names) > ROOT_ENTRIES) fail("too many entries in the root directory");
+
+	// Geometry : the clusters needed, within the FAT16 range
+	track_size = track_kb * 1024;
+	track_clusters = clust_count(track_size);
+	dir_clusters = dirs ? clust_count((entries(tracks) + 2) * 32) : 0;
+
+	need = dirs * dir_clusters + (dirs ? dirs : 1) * tracks * track_clusters;
+	clusters = need + 16 < 4085 + 16 ? 4085 + 16 : need + 16;
+
+	if (clusters >= 65525) fail("too many clusters for FAT16, use larger clusters");
+
+	fatsz = ((clusters + 2) * 2 + BLOCKSIZE - 1) / BLOCKSIZE;
+	part = reserved + 2 * fatsz + rd_sectors + clusters * spc;
+	total = PART_START + part;
+
+	lba_fat = PART_START + reserved;
+	lba_rd = lba_fat + 2 * fatsz;
+	lba_data = lba_rd + rd_sectors;
+
+	fat = calloc(clusters + 2, sizeof(u16));
+	fat[0] = 0xFFF8;
+	fat[1] = 0xFFFF;
+
+	if (!(img = fopen(argv[a], "w+b"))) fail("cannot create the image");
+
+	// Directories, contiguous
+	dir_clust = calloc(dirs + 1, sizeof(u32));
+
+	for (d = 0 ; d < dirs ; d++)
+	{
+		dir_clust[d] = alloc(dir_clusters);
+		n = 0;
+		chain(&n, dir_clust[d], dir_clusters);
+	}
+
+	// Tracks, round robin in fragments
+	n = (dirs ? dirs : 1) * tracks;
+	first = calloc(n, sizeof(u32));
+	last = calloc(n, sizeof(u32));
+	done = calloc(n, sizeof(u32));
+
+	for (left = n * track_clusters ; left ; )
+		for (t = 0 ; t < n ; t++)
+		{
+			i = fragment ? fragment : track_clusters;
+			if (i > track_clusters - done[t]) i = track_clusters - done[t];
+			if (!i) continue;
+
+			j = alloc(i);
+			if (!first[t]) first[t] = j;
+			chain(&last[t], j, i);
+
+			// Track data, the WAV header then the pattern
+			buf = malloc(i * spc * BLOCKSIZE);
+
+			for (o = 0 ; o < i * spc * BLOCKSIZE ; o++)
+				buf[o] = IMAGE_BYTE(t, done[t] * spc * BLOCKSIZE + o);
+
+			if (!done[t])
+			{
+				memcpy(buf, "RIFF", 4);		put32(buf + 4, track_size - 8);
+				memcpy(buf + 8, "WAVEfmt ", 8);	put32(buf + 16, 16);
+				put16(buf + 20, 1);			put16(buf + 22, 2);
+				put32(buf + 24, 44100);		put32(buf + 28, 44100 * 4);
+				put16(buf + 32, 4);			put16(buf + 34, 16);
+				memcpy(buf + 36, "data", 4);	put32(buf + 40, track_size - IMAGE_HEADER);
+			}
+
+			o = (done[t] + i) * spc * BLOCKSIZE > track_size ? track_size - done[t] * spc * BLOCKSIZE : i * spc * BLOCKSIZE;
+			memset(buf + o, 0, i * spc * BLOCKSIZE - o);
+			write_at(clust2lba(j), buf, i * spc * BLOCKSIZE);
+			free(buf);
+
+			done[t] += i;
+			left -= i;
+		}
+
+	// Directory contents
+	root = calloc(rd_sectors, BLOCKSIZE);
+	dir = calloc(dir_clusters ? dir_clusters : 1, spc * BLOCKSIZE);
+
+	for (p = root, d = 0 ; d < (dirs ? dirs : 1) ; d++)
+	{
+		u8 *q = dir;
+
+		if (dirs)
+		{
+			snprintf(name, sizeof(name), "DIR%03u     ", (unsigned) d + 1);
+			snprintf(longname, sizeof(longname), "Album %03u by a band with a long name", (unsigned) d + 1);
+			p = dirent_put(p, name, longname, ATTR_DIRECTORY, dir_clust[d], 0);
+
+			memset(dir, 0, dir_clusters * spc * BLOCKSIZE);
+			memcpy(q, ".          ", 11);	q[11] = ATTR_DIRECTORY;	put16(q + 26, dir_clust[d]);
+			memcpy(q + 32, "..         ", 11);	q[43] = ATTR_DIRECTORY;
+			q += 64;
+		}
+
+		for (t = 0 ; t < tracks ; t++)
+		{
+			i = d * tracks + t;
+			snprintf(name, sizeof(name), "TRK%05uWAV", (unsigned) t + 1);
+			snprintf(longname, sizeof(longname), "%02u - Track number %05u of album.wav", (unsigned) d + 1, (unsigned) t + 1);
+
+			if (dirs)
+				q = dirent_put(q, name, longname, ATTR_ARCHIVE, first[i], track_size);
+			else
+				p = dirent_put(p, name, longname, ATTR_ARCHIVE, first[i], track_size);
+		}
+
+		if (dirs)
+			write_at(clust2lba(dir_clust[d]), dir, dir_clusters * spc * BLOCKSIZE);
+	}
+
+	write_at(lba_rd, root, rd_sectors * BLOCKSIZE);
+
+	// FATs
+	for (i = 0 ; i < 2 ; i++)
+		write_at(lba_fat + i * fatsz, fat, (clusters + 2) * 2);
+
+	// MBR with a single partition
+	memset(sec, 0, sizeof(sec));
+	sec[446 + 4] = part < 65536 ? 0x04 : 0x06;
+	put32(sec + 446 + 8, PART_START);
+	put32(sec + 446 + 12, part);
+	sec[510] = 0x55; sec[511] = 0xAA;
+	write_at(0, sec, BLOCKSIZE);
+
+	// Boot sector
+	memset(sec, 0, sizeof(sec));
+	sec[0] = 0xEB; sec[1] = 0x3C; sec[2] = 0x90;
+	memcpy(sec + 3, "MSWIN4.1", 8);
+	put16(sec + 11, BLOCKSIZE);
+	sec[13] = (u8) spc;
+	put16(sec + 14, reserved);
+	sec[16] = 2;
+	put16(sec + 17, ROOT_ENTRIES);
+	put16(sec + 19, part < 65536 ? part : 0);
+	sec[21] = 0xF8;
+	put16(sec + 22, fatsz);
+	put32(sec + 28, PART_START);
+	put32(sec + 32, part < 65536 ? 0 : part);
+	sec[36] = 0x80;
+	sec[38] = 0x29;
+	put32(sec + 39, 0x12345678);
+	memcpy(sec + 43, "NO NAME    FAT16   ", 19);
+	sec[510] = 0x55; sec[511] = 0xAA;
+	write_at(PART_START, sec, BLOCKSIZE);
+
+	// Give the image its full size
+	memset(sec, 0, sizeof(sec));
+	lba = total - 1;
+	write_at(lba, sec, BLOCKSIZE);
+
+	fclose(img);
+
+	printf("FAT16, %u sectors per cluster, %u of %u clusters used, %u tracks of %uKB in %u directories%s%s\n",
+		spc, next_clust - 2, clusters, n, track_kb, dirs, fragment ? ", fragmented" : "", lfn ? ", long names" : "");
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+#  PHILIPS ARM 2005 DESIGN CONTEST
+#  ENTRY AR1757
+#  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+#
+#  RUN.SH:  build the host tools and run the tests and benchmarks
+#
+#  Usage : tools/host/run.sh [build_dir]
+#
+#  The player's own mmc.c and FFs.c are compiled for the PC, talking to the card
+#  emulator. Exits non-zero if a test fails.
+
+set -e
+
+HOST=$(cd "$(dirname "$0")" && pwd)
+SRC=$HOST/../../src
+OUT=${1:-${TMPDIR:-/tmp}/headstream-host}
+CC=${CC:-cc}
+
+mkdir -p "$OUT/include"
+
+# The sources include headers with the case of the Keil project (Windows)
+ln -sf "$SRC/Timing.h" "$OUT/include/timing.h"
+ln -sf "$SRC/ffs.h" "$OUT/include/FFs.h"
+
+# The player's file functions take the names of the C library ones. Its sources
+# are built without warnings, they are written for a 32-bit target
+CFLAGS="-std=gnu99 -fgnu89-inline -O2 -Dinterrupt=unused -Dputs=host_puts \
+	-Dopen=fs_open -Dread=fs_read -Dclose=fs_close -Dlseek=fs_lseek -Deof=fs_eof \
+	-I$HOST -I$OUT/include -I$SRC"
+
+for f in mmc FFs adpcm flac
+do
+	$CC $CFLAGS -w -c -o "$OUT/$f.o" "$SRC/$f.c"
+done
+
+for f in card host fsbench cardtest codectest
+do
+	$CC $CFLAGS -Wall -Wno-attributes -c -o "$OUT/$f.o" "$HOST/$f.c"
+done
+
+PLAYER="$OUT/mmc.o $OUT/FFs.o $OUT/card.o $OUT/host.o"
+
+$CC -O2 -Wall -o "$OUT/mkimage" "$HOST/mkimage.c"
+$CC -O2 -Wall -o "$OUT/mkadpcm" "$HOST/mkadpcm.c" -lm
+$CC -O2 -Wall -o "$OUT/mkflac" "$HOST/mkflac.c" -lm
+$CC -O2 -w -o "$OUT/mkcard" "$HOST/../mkcard.c"
+$CC -o "$OUT/fsbench" "$OUT/fsbench.o" $PLAYER
+$CC -o "$OUT/cardtest" "$OUT/cardtest.o" $PLAYER
+$CC -o "$OUT/codectest" "$OUT/codectest.o" "$OUT/adpcm.o" "$OUT/flac.o" $PLAYER
+
+# Read commands per refill : contiguous tracks on each card type, with the read
+# latency telemetry, then fragmented tracks
+for type in 0 1 2
+do
+	"$OUT/mkimage" -c 8 -d 2 -t 4 -k 256 "$OUT/card.img" > /dev/null
+	echo "cardtest -t $type -l, contiguous"
+	"$OUT/cardtest" -t $type -l "$OUT/card.img"
+done
+
+for args in "-c 4 -f 1" "-c 1 -f 3" "-c 2 -f 1" "-c 1 -f 1" "-c 16 -f 1"
+do
+	"$OUT/mkimage" $args -t 8 -k 64 "$OUT/card.img" > /dev/null
+	echo "cardtest $args"
+	"$OUT/cardtest" $args "$OUT/card.img"
+done
+
+# File system benchmark : contiguous and fragmented tracks, with long names
+for args in "-c 8 -d 8 -t 16 -k 512" "-c 8 -d 8 -t 16 -k 512 -f 1 -l" "-c 64 -d 4 -t 24 -k 1024 -l" "-c 1 -t 96 -k 128 -f 3"
+do
+	echo
+	echo "mkimage $args"
+	"$OUT/mkimage" $args "$OUT/card.img"
+	"$OUT/fsbench" "$OUT/card.img"
+done
+
+rm -f "$OUT/card.img"
+
+# Decoders : streams written by the reference encoders, on a card made by mkcard
+rm -rf "$OUT/music" "$OUT/expected" "$OUT/codec.img"
+mkdir -p "$OUT/music" "$OUT/expected"
+echo
+"$OUT/mkadpcm" "$OUT/music" "$OUT/expected"
+"$OUT/mkflac" "$OUT/music" "$OUT/expected"
+"$OUT/mkcard" -s 32 "$OUT/music" "$OUT/codec.img" > /dev/null
+echo
+"$OUT/codectest" "$OUT/codec.img" "$OUT/expected"
+rm -rf "$OUT/music" "$OUT/expected" "$OUT/codec.img"
+
+echo
+echo "All tests passed"
@@ -0,0 +1,779 @@
+/*
+**  PHILIPS ARM 2005 DESIGN CONTEST
+**  ENTRY AR1757
+**  FLASH CARD AUDIO PLAYER FOR HEAD END UNIT
+**
+**  MKCARD.C:  PC tool writing a card image laid out for the player
+**
+**  Every track is stored in one run of clusters, with its sample data starting
+**  on a sector boundary, and directories hold their entries in play order.
+**  CATALOG.BIN is written in the format of the player's saved catalog, with
+**  every track flagged contiguous, so the player streams without any FAT access
+**  or directory scan.
+**
+**  Build : cc -O2 -o mkcard mkcard.c
+**  Usage : mkcard [-s size_mb] [-c cluster_kb] [-f] music_dir image
+**
+**  music_dir holds .WAV and .FLAC tracks and subdirectories of them (one level),
+**  played in name order. FLAC files are copied as is, named .FLA on the card.
+**  -f writes a card for a player built without FLAC_DECODER : FLAC files are left
+**  out, as that player does not list them.
+**  image is a file, or the card device itself. FAT16 is used when the cluster
+**  count allows it, FAT32 otherwise. Only 8.3 names are written. Like the
+**  player, this assumes a little endian host.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../src/types.h"
+
+#define BLOCKSIZE		512
+
+// Must match ffs.h and FFs.c
+#define CATALOG_MAX_DIRS	64
+#define CATALOG_MAX_TRACKS	256
+#define CATALOG_MAGIC		0x354C5443	// "CTL5", player built without FLAC_DECODER
+#define CATALOG_MAGIC_FLAC	0x364C5443	// "CTL6", player built with FLAC_DECODER
+#define CATALOG_CONTIG		0x01
+
+typedef struct
+{
+	u32	size;
+	u32	clust;
+	char name[11];
+	u8	flags;
+} catalog_entry;
+
+typedef struct
+{
+	u32 magic;
+	u32 image_size;
+	u32 volid;
+	u32 lba_rd;
+	u32 lba_data;
+	u32 crc;
+
+	u16 dirs;
+	u16 tracks;
+
+	catalog_entry dir[CATALOG_MAX_DIRS + 1];
+	u16 first[CATALOG_MAX_DIRS + 2];
+	catalog_entry track[CATALOG_MAX_TRACKS];
+} catalog;
+
+#define CATALOG_SECTORS	((sizeof(catalog) + BLOCKSIZE - 1) / BLOCKSIZE)
+
+// Volume layout
+#define PART_START		8192	// partition 1st sector, on a 4MB boundary
+#define ROOT_ENTRIES	512		// FAT16 root directory entries
+#define MAX_ENTRIES		1024	// entries per directory handled by this tool
+
+#define ATTR_DIRECTORY	0x10
+#define ATTR_ARCHIVE	0x20
+
+typedef struct entry
+{
+	char path[1024];	// source file or directory
+	char name[11];		// 8.3 name on the card
+	u8	attr;
+	u32 size;			// size on the card
+	u32 fmt_at, fmt_len;	// WAV chunks of the source
+	u32 data_at, data_len;	// data_at 0 if the file is copied as is
+	u32 clust;			// 1st cluster, 0 if none
+	u32 clusters;		// count of clusters
+	u8	*buf;			// directory contents
+	struct entry *sub;	// entries of a directory
+	int subs;
+} entry;
+
+static entry top;		// root directory
+static int flac = 1;		// FLAC tracks listed, the player is built with FLAC_DECODER
+
+// Geometry
+static u32 total, spc, reserved, fatsz, rd_sectors, clusters, volid;
+static u32 lba_fat, lba_rd, lba_data;
+static int fat32;
+static u32 *fat;
+static u32 next_clust = 2;
+static u16 dos_date, dos_time;
+
+static FILE *img;
+static u8 block[65536];
+
+static void fail(const char *msg, const char *arg)
+{
+	fprintf(stderr, "mkcard: %s %s\n", msg, arg ? arg : "");
+	exit(1);
+}
+
+static void put16(u8 *p, u32 v) { p[0] = (u8) v; p[1] = (u8) (v >> 8); }
+static void put32(u8 *p, u32 v) { put16(p, v); put16(p + 2, v >> 16); }
+static u32 get32(const u8 *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24); }
+
+static void write_at(u32 lba, const void *buf, u32 len)
+{
+	if (fseeko(img, (off_t) lba * BLOCKSIZE, SEEK_SET) || fwrite(buf, 1, len, img) != len)
+		fail("write error", NULL);
+}
+
+static u32 clust2lba(u32 clust)
+{
+	return lba_data + (clust - 2) * spc;
+}
+
+static u32 clust_count(u32 bytes)
+{
+	return (bytes + spc * BLOCKSIZE - 1) / (spc * BLOCKSIZE);
+}
+
+//
+// source scanning
+//
+
+static int is_wav(const char *filename)
+{
+	const char *dot = strrchr(filename, '.');
+
+	return dot && !strcasecmp(dot, ".wav");
+}
+
+static int is_track(const char *filename)
+{
+	const char *dot = strrchr(filename, '.');
+
+	return is_wav(filename) || (flac && dot && (!strcasecmp(dot, ".flac") || !strcasecmp(dot, ".fla")));
+}
+
+static const char *base_name(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcasecmp(base_name(((const entry *) a) -> path), base_name(((const entry *) b) -> path));
+}
+
+// Make a 8.3 name unique among the n first entries of dir
+static void make_83(entry *e, entry *dir, int n)
+{
+	const char *filename = base_name(e -> path), *dot = strrchr(filename, '.');
+	int i, j, k, tries;
+	char c;
+
+	if (e -> attr & ATTR_DIRECTORY) dot = NULL;
+
+	for (tries = 0 ; tries < 10 ; tries++)
+	{
+		memset(e -> name, ' ', 11);
+
+		for (i = j = 0 ; filename[i] && &filename[i] != dot && j < 8 ; i++)
+		{
+			c = toupper((u8) filename[i]);
+			if (c == ' ' || c == '.') continue;
+			e -> name[j++] = isalnum((u8) c) ? c : '_';
+		}
+
+		if (tries)
+		{
+			// BASE~N
+			j = j > 6 ? 6 : j;
+			e -> name[j++] = '~';
+			e -> name[j] = '0' + tries;
+		}
+
+		for (i = 0 ; dot && dot[i + 1] && i < 3 ; i++)
+			e -> name[8 + i] = isalnum((u8) dot[i + 1]) ? toupper((u8) dot[i + 1]) : '_';
+
+		for (k = 0 ; k < n && memcmp(dir[k].name, e -> name, 11) ; k++);
+
+		if (k == n) return;
+	}
+
+	fail("too many similar names :", filename);
+}
+
+// Find the fmt and data chunks of a WAV file. The card copy gets a JUNK chunk so
+// that the sample data starts on a sector boundary
+static void scan_wav(entry *e)
+{
+	FILE *f = fopen(e -> path, "rb");
+	u8 hdr[12];
+	u32 at = 12, len, head;
+	struct stat st;
+
+	if (!f || fstat(fileno(f), &st)) fail("cannot read", e -> path);
+
+	e -> size = (u32) st.st_size;
+	e -> data_at = 0;
+
+	// FLAC tracks are copied as is
+	if (!is_wav(e -> path))
+	{
+		fclose(f);
+		return;
+	}
+
+	if (fread(hdr, 1, 12, f) == 12 && !memcmp(hdr, "RIFF", 4) && !memcmp(hdr + 8, "WAVE", 4))
+	{
+		while (!fseeko(f, at, SEEK_SET) && fread(hdr, 1, 8, f) == 8)
+		{
+			len = get32(hdr + 4);
+
+			if (!memcmp(hdr, "fmt ", 4))
+			{
+				e -> fmt_at = at + 8;
+				e -> fmt_len = len;
+			}
+			else if (!memcmp(hdr, "data", 4) && e -> fmt_len)
+			{
+				e -> data_at = at + 8;
+				e -> data_len = len < st.st_size - e -> data_at ? len : st.st_size - e -> data_at;
+				break;
+			}
+
+			at += 8 + ((len + 1) & ~1);
+		}
+	}
+
+	fclose(f);
+
+	if (!e -> data_at)
+	{
+		fprintf(stderr, "mkcard: %s is not a WAV file, copied as is\n", e -> path);
+		return;
+	}
+
+	// RIFF + fmt + JUNK + data headers, rounded up to a whole sector
+	head = 12 + 8 + ((e -> fmt_len + 1) & ~1) + 8 + 8;
+	head = (head + BLOCKSIZE - 1) & ~(BLOCKSIZE - 1);
+
+	e -> size = head + e -> data_len;
+}
+
+static void scan_dir(entry *dir, int depth)
+{
+	DIR *d = opendir(dir -> path);
+	struct dirent *de;
+	struct stat st;
+	entry *e;
+	int i;
+
+	if (!d) fail("cannot open", dir -> path);
+
+	dir -> sub = calloc(MAX_ENTRIES, sizeof(entry));
+
+	while ((de = readdir(d)))
+	{
+		if (de -> d_name[0] == '.') continue;
+
+		if (dir -> subs == MAX_ENTRIES) fail("too many entries in", dir -> path);
+
+		e = &dir -> sub[dir -> subs];
+		if (snprintf(e -> path, sizeof(e -> path), "%s/%s", dir -> path, de -> d_name) >= (int) sizeof(e -> path))
+			fail("path too long", de -> d_name);
+
+		if (stat(e -> path, &st)) continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (depth) continue;	// the player only looks one level down
+			e -> attr = ATTR_DIRECTORY;
+		}
+		else if (is_track(de -> d_name))
+			e -> attr = ATTR_ARCHIVE;
+		else
+			continue;
+
+		dir -> subs++;
+	}
+
+	closedir(d);
+
+	qsort(dir -> sub, dir -> subs, sizeof(entry), by_name);
+
+	for (i = 0 ; i < dir -> subs ; i++)
+	{
+		e = &dir -> sub[i];
+
+		make_83(e, dir -> sub, i);
+
+		if (e -> attr & ATTR_DIRECTORY)
+			scan_dir(e, depth + 1);
+		else
+			scan_wav(e);
+	}
+}
+
+//
+// geometry
+//
+
+// Lay out a volume of total sectors with spc sectors per cluster.
+// Return FAT type (16 or 32) or 0 if the cluster count suits neither
+static int layout(u32 c)
+{
+	u32 part = total - PART_START, rel;
+
+	spc = c;
+
+	for (fat32 = 0 ; fat32 < 2 ; fat32++)
+	{
+		rd_sectors = fat32 ? 0 : ROOT_ENTRIES * 32 / BLOCKSIZE;
+		reserved = fat32 ? 32 : 1;
+
+		// FAT size for the most clusters the partition could hold
+		fatsz = ((part / spc + 2) * (fat32 ? 4 : 2) + BLOCKSIZE - 1) / BLOCKSIZE;
+
+		// Data area on a cluster boundary of the card
+		rel = reserved + 2 * fatsz + rd_sectors;
+		reserved += (spc - (PART_START + rel) % spc) % spc;
+		rel = reserved + 2 * fatsz + rd_sectors;
+
+		clusters = (part - rel) / spc;
+
+		lba_fat = PART_START + reserved;
+		lba_rd = lba_fat + 2 * fatsz;
+		lba_data = lba_rd + rd_sectors;
+
+		if (!fat32 && clusters >= 4085 && clusters < 65525) return 16;
+		if (fat32 && clusters >= 65525) return 32;
+	}
+
+	return 0;
+}
+
+static u32 alloc(u32 count)	// Allocate a chain of count clusters. Return its 1st cluster, 0 if none
+{
+	u32 start = next_clust, i;
+
+	if (!count) return 0;
+
+	if (next_clust + count > clusters + 2) fail("image too small, use -s", NULL);
+
+	for (i = start ; i < start + count ; i++)
+		fat[i] = (i + 1 < start + count) ? i + 1 : 0x0FFFFFFF;
+
+	next_clust += count;
+
+	return start;
+}
+
+//
+// image writing
+//
+
+static void dirent_put(u8 *p, const char *name, u8 attr, u32 clust, u32 size)
+{
+	memcpy(p, name, 11);
+	p[11] = attr;
+	put16(p + 14, dos_time);
+	put16(p + 16, dos_date);
+	put16(p + 18, dos_date);
+	put16(p + 20, clust >> 16);
+	put16(p + 22, dos_time);
+	put16(p + 24, dos_date);
+	put16(p + 26, clust);
+	put32(p + 28, size);
+}
+
+static u32 crc32(u32 crc, const u8 *p, u32 len)	// same CRC as the player's __cat_crc()
+{
+	u8 bit;
+
+	while (len--)
+	{
+		crc ^= *p++;
+		for (bit = 0 ; bit < 8 ; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return crc;
+}
+
+// Sectors of a directory the player's __cat_crc() takes : up to the one holding its end marker
+static u32 crc_sectors(const u8 *buf, u32 sectors)
+{
+	u32 n;
+
+	for (n = 0 ; n < sectors * BLOCKSIZE ; n += 32)
+		if (!buf[n])
+			return n / BLOCKSIZE + 1;
+
+	return sectors;
+}
+
+// The catalog packed as the player saves it : the header and the used entries of dir
+// and first, then the tracks
+static void cat_pack(const catalog *cat, u8 *buf)
+{
+	u32 n = offsetof(catalog, dir) + (cat -> dirs + 1) * sizeof(catalog_entry);
+
+	memcpy(buf, cat, n);
+	memcpy(buf + n, cat -> first, (cat -> dirs + 2) * sizeof(u16));
+	n += (cat -> dirs + 2) * sizeof(u16);
+	memcpy(buf + n, cat -> track, cat -> tracks * sizeof(catalog_entry));
+}
+
+static void write_track(entry *e)
+{
+	FILE *f = fopen(e -> path, "rb");
+	u32 at, left, n, head;
+	off_t pos = (off_t) clust2lba(e -> clust) * BLOCKSIZE;
+	u8 *p = block;
+
+	if (!f) fail("cannot read", e -> path);
+
+	if (e -> data_at)
+	{
+		// Rebuild the headers, padding with a JUNK chunk up to the data chunk
+		head = e -> size - e -> data_len;
+		memset(block, 0, head);
+
+		memcpy(p, "RIFF", 4);	put32(p + 4, e -> size - 8);	memcpy(p + 8, "WAVE", 4);
+		p += 12;
+
+		memcpy(p, "fmt ", 4);	put32(p + 4, e -> fmt_len);
+		fseeko(f, e -> fmt_at, SEEK_SET);
+		if (fread(p + 8, 1, e -> fmt_len, f) != e -> fmt_len) fail("cannot read", e -> path);
+		p += 8 + ((e -> fmt_len + 1) & ~1);
+
+		memcpy(p, "JUNK", 4);	put32(p + 4, block + head - 8 - (p + 8));
+		memcpy(block + head - 8, "data", 4);	put32(block + head - 4, e -> data_len);
+
+		at = e -> data_at;
+		left = e -> data_len;
+
+		if (fseeko(img, pos, SEEK_SET) || fwrite(block, 1, head, img) != head) fail("write error", NULL);
+	}
+	else
+	{
+		at = 0;
+		left = e -> size;
+
+		if (fseeko(img, pos, SEEK_SET)) fail("write error", NULL);
+	}
+
+	fseeko(f, at, SEEK_SET);
+
+	while (left)
+	{
+		n = left < sizeof(block) ? left : sizeof(block);
+
+		if (fread(block, 1, n, f) != n) fail("cannot read", e -> path);
+		if (fwrite(block, 1, n, img) != n) fail("write error", NULL);
+
+		left -= n;
+	}
+
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	static catalog cat;
+	static u8 packed[CATALOG_SECTORS * BLOCKSIZE];
+	u8 sec[BLOCKSIZE], clust[4];
+	u32 mb = 0, ckb = 0, bytes = 0, i, n, lba, fsz, cat_clust;
+	int a, d, j, type = 0;
+	entry *e, *s, *cat_src[CATALOG_MAX_DIRS + 1];
+	time_t now = time(NULL);
+	struct tm *tm = localtime(&now);
+
+	for (a = 1 ; a < argc - 2 ; a++)
+	{
+		if (!strcmp(argv[a], "-s") && a + 1 < argc - 2)
+			mb = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-c") && a + 1 < argc - 2)
+			ckb = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-f"))
+			flac = 0;
+		else
+			break;
+	}
+
+	if (a != argc - 2)
+	{
+		fprintf(stderr, "usage: mkcard [-s size_mb] [-c cluster_kb] [-f] music_dir image\n");
+		return 1;
+	}
+
+	if (ckb & (ckb - 1) || ckb > 64) fail("cluster size must be a power of 2 up to 64KB", NULL);
+
+	snprintf(top.path, sizeof(top.path), "%s", argv[a]);
+	top.attr = ATTR_DIRECTORY;
+	scan_dir(&top, 0);
+
+	dos_date = ((tm -> tm_year - 80) << 9) | ((tm -> tm_mon + 1) << 5) | tm -> tm_mday;
+	dos_time = (tm -> tm_hour << 11) | (tm -> tm_min << 5) | (tm -> tm_sec >> 1);
+	volid = (u32) now;
+
+	// Default size : contents plus room for the file system
+	for (i = 0 ; i < (u32) top.subs ; i++)
+	{
+		e = &top.sub[i];
+		bytes += e -> size >> 10;
+
+		for (j = 0 ; j < e -> subs ; j++)
+			bytes += (e -> sub[j].size >> 10) + 64;
+	}
+
+	total = (mb ? mb : (bytes / 1024) * 11 / 10 + 32) * 2048;
+
+	// Largest clusters give the longest card transfers
+	if (ckb)
+		type = layout(ckb * 2);
+	else
+		for (n = 64 ; n && !(type = layout(n)) ; n >>= 1);
+
+	if (!type) fail("no FAT16/FAT32 layout for this size, change -s or -c", NULL);
+
+	fat = calloc(clusters + 2, sizeof(u32));
+	fat[0] = 0x0FFFFFF8;
+	fat[1] = 0x0FFFFFFF;
+
+	// Allocate directories, then the catalog, then every track in play order
+	if (!fat32 && top.subs + 1 > ROOT_ENTRIES) fail("too many entries in", top.path);
+
+	top.clusters = fat32 ? clust_count((top.subs + 1) * 32) : 0;
+	top.clust = fat32 ? alloc(top.clusters) : 0;
+
+	for (i = 0 ; i < (u32) top.subs ; i++)
+	{
+		e = &top.sub[i];
+
+		if (e -> attr & ATTR_DIRECTORY)
+		{
+			e -> clusters = clust_count((e -> subs + 2) * 32);
+			e -> clust = alloc(e -> clusters);
+		}
+	}
+
+	fsz = CATALOG_SECTORS * BLOCKSIZE;
+	cat_clust = alloc(clust_count(fsz));
+
+	for (i = 0 ; i < (u32) top.subs ; i++)
+	{
+		e = &top.sub[i];
+
+		if (!(e -> attr & ATTR_DIRECTORY))
+			e -> clust = alloc(e -> clusters = clust_count(e -> size));
+		else
+			for (j = 0 ; j < e -> subs ; j++)
+			{
+				s = &e -> sub[j];
+				s -> clust = alloc(s -> clusters = clust_count(s -> size));
+			}
+	}
+
+	// Directories
+	top.buf = calloc(1, fat32 ? top.clusters * spc * BLOCKSIZE : rd_sectors * BLOCKSIZE);
+
+	for (i = 0 ; i < (u32) top.subs ; i++)
+	{
+		e = &top.sub[i];
+
+		dirent_put(top.buf + i * 32, e -> name, e -> attr, e -> clust, (e -> attr & ATTR_DIRECTORY) ? 0 : e -> size);
+
+		if (e -> attr & ATTR_DIRECTORY)
+		{
+			e -> buf = calloc(1, e -> clusters * spc * BLOCKSIZE);
+
+			dirent_put(e -> buf, ".          ", ATTR_DIRECTORY, e -> clust, 0);
+			dirent_put(e -> buf + 32, "..         ", ATTR_DIRECTORY, 0, 0);
+
+			for (j = 0 ; j < e -> subs ; j++)
+				dirent_put(e -> buf + (j + 2) * 32, e -> sub[j].name, ATTR_ARCHIVE, e -> sub[j].clust, e -> sub[j].size);
+		}
+	}
+
+	dirent_put(top.buf + top.subs * 32, "CATALOG BIN", ATTR_ARCHIVE, cat_clust, fsz);
+
+	// Catalog, built the way the player's catalog_build() does
+	memcpy(cat.dir[0].name, "TOP        ", 11);
+	cat_src[0] = &top;
+
+	for (i = 0 ; i < (u32) top.subs && cat.dirs < CATALOG_MAX_DIRS ; i++)
+		if (top.sub[i].attr & ATTR_DIRECTORY)
+		{
+			cat_src[++cat.dirs] = &top.sub[i];
+			memcpy(cat.dir[cat.dirs].name, top.sub[i].name, 11);
+			cat.dir[cat.dirs].clust = top.sub[i].clust;
+		}
+
+	for (d = 0 ; d <= cat.dirs ; d++)
+	{
+		cat.first[d] = cat.tracks;
+
+		for (j = 0 ; j < cat_src[d] -> subs && cat.tracks < CATALOG_MAX_TRACKS ; j++)
+		{
+			s = &cat_src[d] -> sub[j];
+
+			if (s -> attr & ATTR_DIRECTORY) continue;
+
+			memcpy(cat.track[cat.tracks].name, s -> name, 11);
+			cat.track[cat.tracks].clust = s -> clust;
+			cat.track[cat.tracks].size = s -> size;
+			cat.track[cat.tracks].flags = CATALOG_CONTIG;
+			cat.tracks++;
+		}
+	}
+
+	cat.first[d] = cat.tracks;
+
+	cat.magic = flac ? CATALOG_MAGIC_FLAC : CATALOG_MAGIC;
+	cat.image_size = sizeof(catalog);
+	cat.volid = volid;
+	cat.lba_rd = fat32 ? clust2lba(top.clust) : lba_rd;
+	cat.lba_data = lba_data;
+	cat.crc = crc32(~0, top.buf, crc_sectors(top.buf, fat32 ? top.clusters * spc : rd_sectors) * BLOCKSIZE);
+
+	for (d = 1 ; d <= cat.dirs ; d++)
+	{
+		put32(clust, cat.dir[d].clust);
+		cat.crc = crc32(cat.crc, clust, 4);
+	}
+
+	cat.crc = ~cat.crc;
+
+	// Write the image
+	if (!(img = fopen(argv[a + 1], "r+b")) && !(img = fopen(argv[a + 1], "w+b")))
+		fail("cannot create", argv[a + 1]);
+
+	// Clear MBR, boot area, FATs and FAT16 root dir
+	memset(block, 0, sizeof(block));
+
+	for (lba = 0 ; lba < lba_data ; lba += n)
+	{
+		n = lba_data - lba < sizeof(block) / BLOCKSIZE ? lba_data - lba : sizeof(block) / BLOCKSIZE;
+		write_at(lba, block, n * BLOCKSIZE);
+	}
+
+	// MBR with a single partition
+	memset(sec, 0, sizeof(sec));
+	sec[446 + 1] = 0xFE; sec[446 + 2] = 0xFF; sec[446 + 3] = 0xFF;	// CHS unused
+	sec[446 + 4] = fat32 ? 0x0C : (total - PART_START < 65536 ? 0x04 : 0x06);
+	sec[446 + 5] = 0xFE; sec[446 + 6] = 0xFF; sec[446 + 7] = 0xFF;
+	put32(sec + 446 + 8, PART_START);
+	put32(sec + 446 + 12, total - PART_START);
+	sec[510] = 0x55; sec[511] = 0xAA;
+	write_at(0, sec, BLOCKSIZE);
+
+	// Boot sector
+	memset(sec, 0, sizeof(sec));
+	sec[0] = 0xEB; sec[1] = fat32 ? 0x58 : 0x3C; sec[2] = 0x90;
+	memcpy(sec + 3, "MSWIN4.1", 8);
+	put16(sec + 11, BLOCKSIZE);
+	sec[13] = (u8) spc;
+	put16(sec + 14, reserved);
+	sec[16] = 2;
+	put16(sec + 17, fat32 ? 0 : ROOT_ENTRIES);
+	put16(sec + 19, (!fat32 && total - PART_START < 65536) ? total - PART_START : 0);
+	sec[21] = 0xF8;
+	put16(sec + 22, fat32 ? 0 : fatsz);
+	put16(sec + 24, 63);
+	put16(sec + 26, 255);
+	put32(sec + 28, PART_START);
+	put32(sec + 32, (!fat32 && total - PART_START < 65536) ? 0 : total - PART_START);
+
+	if (fat32)
+	{
+		put32(sec + 36, fatsz);
+		put32(sec + 44, top.clust);
+		put16(sec + 48, 1);		// FSInfo
+		put16(sec + 50, 6);		// backup boot sector
+		sec[64] = 0x80;
+		sec[66] = 0x29;
+		put32(sec + 67, volid);
+		memcpy(sec + 71, "NO NAME    FAT32   ", 19);
+	}
+	else
+	{
+		sec[36] = 0x80;
+		sec[38] = 0x29;
+		put32(sec + 39, volid);
+		memcpy(sec + 43, "NO NAME    FAT16   ", 19);
+	}
+
+	sec[510] = 0x55; sec[511] = 0xAA;
+	write_at(PART_START, sec, BLOCKSIZE);
+
+	if (fat32)
+	{
+		write_at(PART_START + 6, sec, BLOCKSIZE);
+
+		memset(sec, 0, sizeof(sec));
+		put32(sec, 0x41615252);
+		put32(sec + 484, 0x61417272);
+		put32(sec + 488, clusters + 2 - next_clust);
+		put32(sec + 492, next_clust);
+		sec[510] = 0x55; sec[511] = 0xAA;
+		write_at(PART_START + 1, sec, BLOCKSIZE);
+		write_at(PART_START + 7, sec, BLOCKSIZE);
+	}
+
+	// FATs, only the part in use as the rest was cleared
+	for (n = 0 ; n < 2 ; n++)
+		for (i = 0 ; i < next_clust ; i += BLOCKSIZE / (fat32 ? 4 : 2))
+		{
+			memset(sec, 0, sizeof(sec));
+
+			for (j = 0 ; j < BLOCKSIZE / (fat32 ? 4 : 2) && i + j < next_clust ; j++)
+				if (fat32)
+					put32(sec + j * 4, fat[i + j]);
+				else
+					put16(sec + j * 2, fat[i + j] >= 0x0FFFFFF8 ? 0xFFFF : fat[i + j]);
+
+			write_at(lba_fat + n * fatsz + i / (BLOCKSIZE / (fat32 ? 4 : 2)), sec, BLOCKSIZE);
+		}
+
+	// Directories, catalog and tracks
+	if (fat32)
+		write_at(clust2lba(top.clust), top.buf, top.clusters * spc * BLOCKSIZE);
+	else
+		write_at(lba_rd, top.buf, rd_sectors * BLOCKSIZE);
+
+	for (i = 0 ; i < (u32) top.subs ; i++)
+		if (top.sub[i].attr & ATTR_DIRECTORY)
+			write_at(clust2lba(top.sub[i].clust), top.sub[i].buf, top.sub[i].clusters * spc * BLOCKSIZE);
+
+	cat_pack(&cat, packed);
+	write_at(clust2lba(cat_clust), packed, sizeof(packed));
+
+	for (i = 0 ; i < (u32) top.subs ; i++)
+	{
+		e = &top.sub[i];
+
+		if (!(e -> attr & ATTR_DIRECTORY))
+		{
+			if (e -> clust) write_track(e);
+		}
+		else
+			for (j = 0 ; j < e -> subs ; j++)
+				if (e -> sub[j].clust) write_track(&e -> sub[j]);
+	}
+
+	// Give an image file its full size
+	memset(sec, 0, sizeof(sec));
+	write_at(total - 1, sec, BLOCKSIZE);
+
+	fclose(img);
+
+	printf("FAT%d, %u sectors per cluster, %u of %u clusters used, %u tracks indexed\n",
+		type, spc, next_clust - 2, clusters, cat.tracks);
+
+	return 0;
+}